@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of features in one frame
+#define ALINA_CODE_SIZE 40
+
+// Maximal number of frames given to alina_multi_stream_push_lower at once
+#define ALINA_MAX_BURST 16
+
+// Immutable weights. One model can be shared by any number of streams and threads.
+typedef struct alina_model alina_model;
+
+// Recurrent state of one audio stream. A stream must not be used by several threads at once.
+typedef struct alina_stream alina_stream;
+
+// The architecture of the model is found by the file size.
+// Returns NULL if the file can't be read or no architecture has its size.
+alina_model *alina_model_load(const char *name);
+
+// Copy of the weights being trained by train_epoch
+alina_model *alina_model_snapshot(void);
+
+// Name of the architecture, which sets the sizes of the layers
+const char *alina_model_architecture(const alina_model *model);
+
+// Returns 0 on success
+int alina_model_save(const alina_model *model, const char *name);
+
+// Applies the model to s frames starting from the initial state. Returns maximal probability.
+float alina_model_apply_to(const alina_model *model, const float *arr, size_t s, float *out);
+
+// Multiplications per frame relative to the dense network, 1 if the model is evaluated densely
+float alina_model_cost(const alina_model *model);
+
+// Pruned models are timed with block sparse and dense kernels when loaded and the faster ones are used.
+// Returns how many times the sparse kernels are faster, 1 if the model is evaluated densely.
+float alina_model_speedup(const alina_model *model);
+
+// The weights are freed when the last stream using them is freed
+void alina_model_free(alina_model *model);
+
+// capacity is the number of probabilities which can be pushed without reading them
+alina_stream *alina_stream_create(const alina_model *model, size_t capacity);
+
+// Consumes up to n frames of ALINA_CODE_SIZE floats and returns how many were consumed.
+// Stops early when there is no space left for probabilities. Doesn't allocate memory.
+size_t alina_stream_push(alina_stream *stream, const float *frames, size_t n);
+
+// Pushes one frame to each of n streams and evaluates them together, which is faster than separate pushes.
+// All streams must use the same model and have space for one probability. Doesn't allocate memory.
+void alina_stream_push_batch(alina_stream *const *streams, const float *frames, size_t n);
+
+// Moves up to n oldest probabilities to out and returns their number
+size_t alina_stream_read(alina_stream *stream, float *out, size_t n);
+
+// Clears recurrent state and unread probabilities
+void alina_stream_reset(alina_stream *stream);
+
+void alina_stream_free(alina_stream *stream);
+
+// State of one audio stream evaluated by several models, one per keyword.
+// The front-end is evaluated once per frame. Lower layers are evaluated once for all
+// models trained with the same frozen lower layers (see freeze_lower). The GRU and
+// the upper layers of every model are evaluated separately. Models can have different architectures,
+// only models of the same architecture share lower layers.
+typedef struct alina_multi_stream alina_multi_stream;
+
+alina_multi_stream *alina_multi_stream_create(const alina_model *const *models, size_t n);
+
+// Number of distinct lower layer stacks evaluated per frame
+size_t alina_multi_stream_lower_count(const alina_multi_stream *stream);
+
+// Consumes one frame of ALINA_CODE_SIZE floats and writes one probability per model to out.
+// Doesn't allocate memory.
+void alina_multi_stream_push(alina_multi_stream *stream, const float *frame, float *out);
+
+// Same as alina_multi_stream_push for n <= ALINA_MAX_BURST frames received at once. The lower layers
+// have no state, so they are evaluated for all frames together by push_lower. Each of the next n calls of
+// step evaluates the rest for one frame and writes one probability per model to out, resets can be done
+// between them. Doesn't allocate memory.
+void alina_multi_stream_push_lower(alina_multi_stream *stream, const float *frames, size_t n);
+
+void alina_multi_stream_step(alina_multi_stream *stream, float *out);
+
+// Clears recurrent state of one model
+void alina_multi_stream_reset(alina_multi_stream *stream, size_t head);
+
+void alina_multi_stream_free(alina_multi_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
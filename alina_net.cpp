@@ -6,18 +6,28 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <ctime>
 #include <fstream>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <cstring>
 #include "fastrnn/variable.hpp"
 #include "fastrnn/executer.hpp"
 #include "fastrnn/gru.hpp"
 #include "fastrnn/allocator.hpp"
 #include "fastrnn/optimizer.hpp"
 #include "fastrnn/linear.hpp"
+#include "sparse.hpp"
+#include "model.hpp"
 
 using namespace fastrnn;
 
-TensorAllocator<float, (size_t) 1 << 20, true> alloc;
+using Allocator = TensorAllocator<float, (size_t) 1 << 20, true>;
 
 template<size_t n, class Executer = StaticExecuter<1>>
 void add_cross_entropy_loss(
@@ -26,6 +36,7 @@ void add_cross_entropy_loss(
     float w,
     Variable<Tensor<float>> l,
     GradientCalculator &calc,
+    Allocator &alloc,
     Executer &exe = Executer::object)
 {
     size_t max_index = std::max_element(x.data->begin(), x.data->end()) - x.data->begin();
@@ -48,9 +59,7 @@ void add_cross_entropy_loss(
     );
 }
 
-std::mt19937 rnd;
-
-float frand() {
+float frand(std::mt19937 &rnd) {
     return ((float) rnd() / (rnd.max() / 2) - 1) * 0.05;
 }
 
@@ -58,233 +67,1015 @@ float frand() {
 #define THREADS 1
 #endif
 
-StaticExecuter<THREADS> *exe;
-
-Linear<float, code_size, linear_size, true> l1;
-Linear<float, linear_size, linear_size, true> l2;
-Linear<float, linear_size, linear_size, true> l3;
-GRUCell<float, linear_size, hidden_size, true> cell;
-Linear<float, hidden_size, linear_size, true> l4;
-Linear<float, linear_size, linear_size, true> l5;
-Linear<float, linear_size, 2, true> l6;
-
-std::vector<std::pair<std::vector<Tensor<float, code_size>>, bool>> dataset;
-
-RMSPropOptimizer<float> *opt = nullptr;
-
-float apply_once(const Tensor<float, code_size> &x, Tensor<float, hidden_size> &h) {
-    Tensor<float, linear_size> o1, o2, o3, o4, o5;
-    Tensor<float, 2> o6;
-    Tensor<float, hidden_size> nh;
-    l1.no_grad()(x, o1);
-    relu(o1, o1);
-    l2.no_grad()(o1, o2);
-    relu(o2, o2);
-    l3.no_grad()(o2, o3);
-    relu(o3, o3);
-    cell.no_grad()(o3, h, nh);
-    h = nh;
-    l4.no_grad()(h, o4);
-    relu(o4, o4);
-    l5.no_grad()(o4, o5);
-    relu(o5, o5);
-    l6.no_grad()(o5, o6);
-    o6 -= *std::max_element(o6.begin(), o6.end());
-    exp(o6, o6);
-    return o6[1] / (o6[0] + o6[1]);
+
+// The only place where sizes of the networks are set, Model generates everything else from them.
+// All architectures take code_size features, so the front-end and the C API are the same for them.
+using Net = Model<Sizes<code_size, linear_size, linear_size, linear_size>, hidden_size, Sizes<linear_size, linear_size, 2>>;
+using SmallNet = Model<Sizes<code_size, 64, 64>, 64, Sizes<64, 2>>;
+
+template<class M>
+constexpr const char *architecture_name = nullptr;
+template<>
+constexpr const char *architecture_name<Net> = "default";
+template<>
+constexpr const char *architecture_name<SmallNet> = "small";
+
+// Calls f(std::type_identity<M>()) for every architecture until it returns true
+template<class F>
+bool for_each_architecture(F &&f) {
+    return f(std::type_identity<Net>()) || f(std::type_identity<SmallNet>());
+}
+
+// Weights files are told apart by their size
+static_assert(Net::file_size() != SmallNet::file_size());
+
+template<size_t n>
+void fill_random(Tensor<float, n> &x, std::mt19937 &gen) {
+    std::uniform_real_distribution<float> dist(-1, 1);
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = dist(gen);
+    }
+}
+
+template<size_t in, size_t out>
+MatrixRef matrix_ref(Linear<float, in, out, true> &l) {
+    return {l.W.data(), out, in, FASTRNN_LAYOUT.linear_transposed};
+}
+
+struct SparseLinear {
+    template<size_t in, size_t out>
+    explicit SparseLinear(Linear<float, in, out, true> &l): W(matrix_ref(l)), b(l.b.data(), l.b.data() + out) {}
+
+    void operator()(const float *x, float *y) const {
+        std::copy(b.begin(), b.end(), y);
+        W.multiply_add(x, y);
+    }
+
+    BlockSparseMatrix W;
+    std::vector<float> b;
+};
+
+// The kernel points to the biases owned by the object, so it is not copied
+template<class M>
+struct SparseGRU {
+    static constexpr size_t in = M::feature_size, hidden = M::state_size;
+
+    explicit SparseGRU(typename M::Cell &cell):
+        br(cell.br.data(), cell.br.data() + hidden),
+        bz(cell.bz.data(), cell.bz.data() + hidden),
+        bh(cell.bh.data(), cell.bh.data() + hidden),
+        kernel{w(cell.Wr), u(cell.Ur), w(cell.Wz), u(cell.Uz), w(cell.Wh), u(cell.Uh), br.data(), bz.data(), bh.data()} {}
+    SparseGRU(const SparseGRU &) = delete;
+
+    void operator()(const float *x, float *h) const {
+        kernel.template operator()<1>(x, h, 1);
+    }
+
+    size_t cost() const {
+        auto &k = kernel;
+        return k.Wr.cost() + k.Ur.cost() + k.Wz.cost() + k.Uz.cost() + k.Wh.cost() + k.Uh.cost();
+    }
+
+    std::vector<float> br, bz, bh;
+    GRUKernel<BlockSparseMatrix, in, hidden> kernel;
+private:
+    template<class T>
+    static BlockSparseMatrix w(T &t) {
+        return BlockSparseMatrix({t.data(), hidden, in, FASTRNN_LAYOUT.w_transposed});
+    }
+
+    template<class T>
+    static BlockSparseMatrix u(T &t) {
+        return BlockSparseMatrix({t.data(), hidden, hidden, FASTRNN_LAYOUT.u_transposed});
+    }
+};
+
+// Inference with block sparse weights. Pruned neurons are kept as zero rows and columns,
+// so the state has the same shape as in the dense model.
+template<class M>
+struct SparseModel {
+    using Input = typename M::Input;
+    using State = typename M::State;
+    static constexpr size_t input_size = M::input_size;
+    static constexpr size_t max_size = std::max(M::Lower::max_size, M::Upper::max_size);
+
+    explicit SparseModel(M &n): cell(n.cell) {
+        n.lower.for_each_layer([this](auto &l) {
+            lower.emplace_back(l);
+        });
+        n.upper.for_each_layer([this](auto &l) {
+            upper.emplace_back(l);
+        });
+    }
+
+    float apply_once(const Input &x, State &h) const {
+        float a[max_size], b[max_size];
+        float *out = a, *other = b;
+        const float *in = x.data();
+        auto relu = [](float *v, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                v[i] = std::max(v[i], 0.0f);
+            }
+        };
+        for (size_t k = 0; k < lower.size(); ++k) {
+            lower[k](in, out);
+            relu(out, M::Lower::size[k + 1]);
+            in = out;
+            std::swap(out, other);
+        }
+        cell(in, h.data());
+        in = h.data();
+        for (size_t k = 0; k < upper.size(); ++k) {
+            upper[k](in, out);
+            if (k + 1 < upper.size()) {
+                relu(out, M::Upper::size[k + 1]);
+            }
+            in = out;
+            std::swap(out, other);
+        }
+        float mx = std::max(in[0], in[1]);
+        float e0 = std::exp(in[0] - mx), e1 = std::exp(in[1] - mx);
+        return e1 / (e0 + e1);
+    }
+
+    float apply_to(const float *arr, size_t s, float *out) const {
+        return apply_sequence(*this, arr, s, out);
+    }
+
+    size_t cost() const {
+        size_t ans = cell.cost();
+        for (auto &l : lower) {
+            ans += l.W.cost();
+        }
+        for (auto &l : upper) {
+            ans += l.W.cost();
+        }
+        return ans;
+    }
+
+    std::vector<SparseLinear> lower;
+    SparseGRU<M> cell;
+    std::vector<SparseLinear> upper;
+    // Time of the dense model divided by the time of this one, measured by compile_sparse
+    float speedup = 1;
+};
+
+// Shortest of several runs of f in seconds
+template<class F>
+double min_time(F &&f) {
+    double ans = std::numeric_limits<double>::max();
+    for (int run = 0; run < 5; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        ans = std::min(ans, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return ans;
+}
+
+// Both models are timed on random frames, returns nullptr if the dense one is faster
+template<class M>
+std::shared_ptr<SparseModel<M>> compile_sparse(M &n) {
+    if (!M::raw_kernels()) {
+        return nullptr;
+    }
+    auto sparse = std::make_shared<SparseModel<M>>(n);
+    // Without pruned blocks the sparse kernels can't be faster
+    if (sparse->cost() >= M::multiplications()) {
+        return nullptr;
+    }
+    std::mt19937 gen(2);
+    std::vector<typename M::Input> x(100);
+    for (auto &t : x) {
+        fill_random(t, gen);
+    }
+    std::vector<float> expected(x.size()), res(x.size());
+    auto dense_time = min_time([&] {
+        n.apply_to(x[0].data(), x.size(), expected.data());
+    });
+    auto sparse_time = min_time([&] {
+        sparse->apply_to(x[0].data(), x.size(), res.data());
+    });
+    for (size_t i = 0; i < x.size(); ++i) {
+        if (std::abs(expected[i] - res[i]) > 1e-3) {
+            std::cerr << "Sparse model differs from the dense one, dense inference is used\n";
+            return nullptr;
+        }
+    }
+    sparse->speedup = dense_time / sparse_time;
+    return sparse->speedup > 1 ? sparse : nullptr;
+}
+
+// Weight matrices in the order used by pruning: the lower stack, Wr, Ur, Wz, Uz, Wh, Uh, the upper stack
+template<class M>
+std::vector<MatrixRef> weight_matrices(M &n) {
+    std::vector<MatrixRef> ans;
+    n.lower.for_each_layer([&ans](auto &l) {
+        ans.emplace_back(matrix_ref(l));
+    });
+    auto &c = n.cell;
+    const size_t in = M::feature_size, hidden = M::state_size;
+    const bool w = FASTRNN_LAYOUT.w_transposed, u = FASTRNN_LAYOUT.u_transposed;
+    ans.insert(ans.end(), {
+        {c.Wr.data(), hidden, in, w},
+        {c.Ur.data(), hidden, hidden, u},
+        {c.Wz.data(), hidden, in, w},
+        {c.Uz.data(), hidden, hidden, u},
+        {c.Wh.data(), hidden, in, w},
+        {c.Uh.data(), hidden, hidden, u},
+    });
+    n.upper.for_each_layer([&ans](auto &l) {
+        ans.emplace_back(matrix_ref(l));
+    });
+    return ans;
+}
+
+// The lower stack, br, bz, bh, the upper stack
+template<class M>
+std::vector<float *> biases(M &n) {
+    std::vector<float *> ans;
+    n.lower.for_each_layer([&ans](auto &l) {
+        ans.emplace_back(l.b.data());
+    });
+    ans.insert(ans.end(), {n.cell.br.data(), n.cell.bz.data(), n.cell.bh.data()});
+    n.upper.for_each_layer([&ans](auto &l) {
+        ans.emplace_back(l.b.data());
+    });
+    return ans;
+}
+
+// Neurons are pruned in groups of BlockSparseMatrix::BLOCK, so a pruned group removes whole
+// block rows of the matrices computing it and whole block columns of the matrices using it.
+// Indices are in weight_matrices and biases.
+struct NeuronLayer {
+    std::vector<size_t> producers, biases, consumers;
+    size_t size;
+    bool lower;
+};
+
+template<class M>
+std::vector<NeuronLayer> neuron_layers() {
+    const size_t L = M::Lower::depth, U = M::Upper::depth;
+    std::vector<NeuronLayer> ans;
+    for (size_t k = 0; k < L; ++k) {
+        std::vector<size_t> consumers{k + 1};
+        if (k + 1 == L) {
+            consumers = {L, L + 2, L + 4};
+        }
+        ans.push_back({{k}, {k}, consumers, M::Lower::size[k + 1], true});
+    }
+    ans.push_back({{L, L + 1, L + 2, L + 3, L + 4, L + 5}, {L, L + 1, L + 2}, {L + 1, L + 3, L + 5, L + 6}, M::state_size, false});
+    // Outputs of the last layer are not pruned
+    for (size_t k = 0; k + 1 < U; ++k) {
+        ans.push_back({{L + 6 + k}, {L + 3 + k}, {L + 7 + k}, M::Upper::size[k + 1], false});
+    }
+    return ans;
+}
+
+// Weights being trained and everything needed to train them. Trainers don't share
+// anything, so several configurations can be trained concurrently on one dataset.
+template<class M>
+struct BasicTrainer {
+    BasicTrainer() = default;
+    BasicTrainer(uint32_t seed, float lr, float positive_weight) {
+        init(seed, lr, positive_weight);
+    }
+
+    void init(uint32_t seed, float lr, float positive_weight) {
+        auto frand = [this] {
+            return ::frand(rnd);
+        };
+        rnd.seed(seed);
+        this->lr = lr;
+        this->positive_weight = positive_weight;
+        opt = std::make_unique<RMSPropOptimizer<float>>(lr);
+        net.register_in_optimizer(*opt, true);
+        net.init(frand);
+        lower_frozen = false;
+        mask.reset();
+    }
+
+    // The weights are not changed if the file can't be read
+    bool freeze_lower(const char *name) {
+        auto base = std::make_unique<M>();
+        if (!base->load(name)) {
+            return false;
+        }
+        net.lower = base->lower;
+        opt = std::make_unique<RMSPropOptimizer<float>>(lr);
+        net.register_in_optimizer(*opt, false);
+        lower_frozen = true;
+        return true;
+    }
+
+    void apply_mask() {
+        std::vector<float *> m;
+        mask->for_each_param([&m](auto &t) {
+            m.emplace_back(t.data());
+        });
+        auto it = m.begin();
+        net.for_each_param([&it](auto &t) {
+            auto p = *it++;
+            for (size_t i = 0; i < sizeof(t) / sizeof(float); ++i) {
+                t.data()[i] *= p[i];
+            }
+        });
+    }
+
+    void prune(float neurons, float blocks) {
+        if (!(neurons >= 0 && neurons <= 1 && blocks >= 0 && blocks <= 1)) {
+            std::cerr << "Pruned fractions must be from 0 to 1, pruning is skipped\n";
+            return;
+        }
+        // The weights are pruned in FASTRNN_LAYOUT
+        if (!M::raw_kernels()) {
+            std::cerr << "Unknown weights layout, pruning is skipped\n";
+            return;
+        }
+        if (!mask) {
+            mask = std::make_unique<M>(net);
+            mask->for_each_param([](auto &t) {
+                std::fill(t.data(), t.data() + sizeof(t) / sizeof(float), 1.0f);
+            });
+        }
+        const size_t B = BlockSparseMatrix::BLOCK;
+        auto w = weight_matrices(net);
+        auto m = weight_matrices(*mask);
+        auto b = biases(*mask);
+        auto trainable = [this](size_t matrix) {
+            return !lower_frozen || matrix >= M::Lower::depth;
+        };
+
+        for (auto &layer : neuron_layers<M>()) {
+            if (layer.lower && lower_frozen) {
+                continue;
+            }
+            std::vector<std::pair<float, size_t>> norms;
+            for (size_t g = 0; g < layer.size; g += B) {
+                float norm = 0;
+                for (auto k : layer.producers) {
+                    for (size_t o = g; o < g + B; ++o) {
+                        for (size_t i = 0; i < w[k].in; ++i) {
+                            norm += w[k](o, i) * w[k](o, i);
+                        }
+                    }
+                }
+                norms.emplace_back(norm, g);
+            }
+            size_t count = neurons * norms.size();
+            std::nth_element(norms.begin(), norms.begin() + count, norms.end());
+            for (size_t j = 0; j < count; ++j) {
+                size_t g = norms[j].second;
+                for (size_t o = g; o < g + B; ++o) {
+                    for (auto k : layer.producers) {
+                        for (size_t i = 0; i < m[k].in; ++i) {
+                            m[k](o, i) = 0;
+                        }
+                    }
+                    for (auto k : layer.biases) {
+                        b[k][o] = 0;
+                    }
+                    for (auto k : layer.consumers) {
+                        for (size_t i = 0; i < m[k].out; ++i) {
+                            m[k](i, o) = 0;
+                        }
+                    }
+                }
+            }
+        }
+
+        for (size_t k = 0; k < w.size(); ++k) {
+            if (!trainable(k)) {
+                continue;
+            }
+            std::vector<std::tuple<float, size_t, size_t>> norms;
+            for (size_t r = 0; r < w[k].out; r += B) {
+                for (size_t c = 0; c < w[k].in; c += B) {
+                    float norm = 0;
+                    for (size_t o = r; o < std::min(r + B, w[k].out); ++o) {
+                        for (size_t i = c; i < c + B; ++i) {
+                            norm += w[k](o, i) * w[k](o, i) * m[k](o, i);
+                        }
+                    }
+                    norms.emplace_back(norm, r, c);
+                }
+            }
+            size_t count = blocks * norms.size();
+            std::nth_element(norms.begin(), norms.begin() + count, norms.end());
+            for (size_t j = 0; j < count; ++j) {
+                auto [norm, r, c] = norms[j];
+                for (size_t o = r; o < std::min(r + B, w[k].out); ++o) {
+                    for (size_t i = c; i < c + B; ++i) {
+                        m[k](o, i) = 0;
+                    }
+                }
+            }
+        }
+        apply_mask();
+    }
+
+    // next(i) returns the i-th sample of the epoch or nullptr when there are no more samples.
+    // The sample must stay alive until the end of its series.
+    template<class Next>
+    void train_on(size_t n, size_t seq, float *losses, Next &&next) {
+        const size_t state_size = M::state_size, feature_size = M::feature_size;
+        auto exe = std::make_unique<StaticExecuter<THREADS>>();
+        GradientCalculator calc;
+        auto &alloc = *this->alloc;
+        alloc.reset();
+        Variable h(*alloc.allocate<state_size>(), *alloc.allocate<state_size>());
+        Tensor<float> l(0), l_(0);
+        Variable var_l(l, l_);
+        int cnt = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto sample = next(i);
+            if (!sample) {
+                break;
+            }
+            if (i % seq == 0) {
+                alloc.reset();
+                opt->zero_grad();
+                h = Variable(*alloc.allocate<state_size>(), *alloc.allocate<state_size>());
+                l = 0;
+                cnt = 0;
+            }
+            auto &X = sample->first;
+            auto y = sample->second;
+            for (size_t j = 0; j < X.size(); ++j) {
+                auto &x = X[j];
+                auto features = [&] {
+                    if (lower_frozen) {
+                        Variable o(*alloc.allocate<feature_size>(), *alloc.allocate<feature_size>());
+                        net.lower_batch(&x, o.data, 1);
+                        return o;
+                    }
+                    return net.lower.graph(x, calc, alloc, *exe);
+                }();
+                Variable new_h(*alloc.allocate<state_size>(), *alloc.allocate<state_size>());
+                net.cell(features, h, new_h, calc, alloc, *exe);
+                h = new_h;
+                if (!y || j + 50 >= X.size()) {
+                    auto logits = net.upper.graph(h, calc, alloc, *exe);
+                    ++cnt;
+                    add_cross_entropy_loss(logits, y, y ? positive_weight : 1, var_l, calc, alloc, *exe);
+                }
+            }
+            if (i % seq == (seq - 1)) {
+                Variable mean_l(*alloc.allocate<>(), *alloc.allocate<>());
+                if (cnt) {
+                    calc.apply_func(var_l, mean_l, [cnt](auto sum, auto &mean) {
+                        mean += sum / cnt;
+                    }, [cnt](auto, auto, auto &sum_, auto mean_) {
+                        sum_ += mean_ / cnt;
+                    });
+                }
+                calc.backward(mean_l);
+                *losses++ = l / cnt;
+                opt->step();
+                if (mask) {
+                    apply_mask();
+                }
+            }
+        }
+    }
+
+    // The graph allocator is large, so it is kept out of the object
+    std::unique_ptr<Allocator> alloc = std::make_unique<Allocator>();
+    std::mt19937 rnd;
+    M net;
+    std::unique_ptr<RMSPropOptimizer<float>> opt;
+    // 1 for trained weights and 0 for pruned ones, nullptr if nothing is pruned
+    std::unique_ptr<M> mask;
+    // The lower stack is taken from another model and is not trained
+    bool lower_frozen = false;
+    float lr = 1e-3, positive_weight = 100;
+};
+
+static_assert(code_size == ALINA_CODE_SIZE);
+
+// Recurrent state and unread probabilities of a stream, the state type depends on the architecture
+struct alina_stream {
+    explicit alina_stream(size_t capacity): probs(capacity) {}
+    virtual ~alina_stream() = default;
+
+    // Evaluates one frame of code_size features, there must be space for its probability
+    virtual void push(const float *frame) = 0;
+
+    // Same for n streams of the same model, one of which is this one
+    virtual void push_batch(alina_stream *const *streams, const float *frames, size_t n) = 0;
+
+    virtual void reset_state() = 0;
+
+    void add(float prob) {
+        probs[(head + count) % probs.size()] = prob;
+        ++count;
+    }
+
+    std::vector<float> probs;
+    size_t head = 0, count = 0;
+};
+
+template<class M>
+struct StreamOf : alina_stream {
+    StreamOf(std::shared_ptr<M> net, std::shared_ptr<SparseModel<M>> sparse, size_t capacity):
+        alina_stream(capacity), net(std::move(net)), sparse(std::move(sparse)), h(0) {}
+
+    void push(const float *frame) override {
+        typename M::Input x;
+        memcpy(x.data(), frame, sizeof(x));
+        add(sparse ? sparse->apply_once(x, h) : net->apply_once(x, h));
+    }
+
+    void push_batch(alina_stream *const *streams, const float *frames, size_t n) override {
+        if (sparse) {
+            // Sparse models are evaluated one stream at a time
+            for (size_t i = 0; i < n; ++i) {
+                streams[i]->push(frames + i * M::input_size);
+            }
+            return;
+        }
+        typename M::Input x[M::max_batch];
+        typename M::State *h[M::max_batch];
+        float out[M::max_batch];
+        for (size_t from = 0; from < n; from += M::max_batch) {
+            size_t m = std::min(M::max_batch, n - from);
+            for (size_t i = 0; i < m; ++i) {
+                memcpy(x[i].data(), frames + (from + i) * M::input_size, sizeof(x[i]));
+                h[i] = &static_cast<StreamOf *>(streams[from + i])->h;
+            }
+            net->apply_batch(x, h, out, m);
+            for (size_t i = 0; i < m; ++i) {
+                streams[from + i]->add(out[i]);
+            }
+        }
+    }
+
+    void reset_state() override {
+        h = 0;
+    }
+
+    std::shared_ptr<M> net;
+    std::shared_ptr<SparseModel<M>> sparse;
+    typename M::State h;
+};
+
+// Heads of alina_multi_stream with one architecture, only they can share lower layers
+struct HeadGroup {
+    virtual ~HeadGroup() = default;
+
+    // Adds the model as head of the multi stream, returns false if it has another architecture
+    virtual bool add(const alina_model *model, size_t head) = 0;
+
+    // Evaluates the lower layers of n <= ALINA_MAX_BURST frames and keeps their outputs for step
+    virtual void push_lower(const float *frames, size_t n) = 0;
+
+    // Evaluates the rest for the next frame given to push_lower and writes probabilities of the heads of the group to out
+    virtual void step(float *out) = 0;
+
+    virtual void reset(size_t head) = 0;
+
+    virtual size_t lower_count() const = 0;
+};
+
+template<class M>
+struct ModelOf;
+
+template<class M>
+struct HeadGroupOf : HeadGroup {
+    bool add(const alina_model *model, size_t head) override {
+        auto m = dynamic_cast<const ModelOf<M> *>(model);
+        if (!m) {
+            return false;
+        }
+        size_t i = nets.size();
+        nets.emplace_back(m->net);
+        sparse.emplace_back(m->sparse);
+        size_t j = 0;
+        while (j < i && !(lower[j] == j && !sparse[j] && !sparse[i] &&
+                (nets[j] == nets[i] || nets[j]->same_lower(*nets[i])))) {
+            ++j;
+        }
+        lower.emplace_back(j);
+        heads.emplace_back(head);
+        features.resize(nets.size() * ALINA_MAX_BURST);
+        h.emplace_back(0);
+        return true;
+    }
+
+    // The lower layers have no state, so every weight matrix is multiplied by up to max_batch frames at once
+    void push_lower(const float *frames, size_t n) override {
+        for (size_t t = 0; t < n; ++t) {
+            memcpy(x[t].data(), frames + t * M::input_size, sizeof(x[t]));
+        }
+        for (size_t i = 0; i < nets.size(); ++i) {
+            if (lower[i] != i || sparse[i]) {
+                continue;
+            }
+            for (size_t from = 0; from < n; from += M::max_batch) {
+                nets[i]->lower_batch(&x[from], &features[i * ALINA_MAX_BURST + from], std::min(M::max_batch, n - from));
+            }
+        }
+        next = 0;
+    }
+
+    void step(float *out) override {
+        // Heads are not fused into one GRU: stacking their input weights into one product does the same
+        // multiplications and measured no faster, and the recurrent and upper weights of different heads
+        // act on different vectors, so a stacked matrix would be block diagonal
+        for (size_t i = 0; i < nets.size(); ++i) {
+            if (sparse[i]) {
+                out[heads[i]] = sparse[i]->apply_once(x[next], h[i]);
+                continue;
+            }
+            auto p = &h[i];
+            nets[i]->upper_batch(&features[lower[i] * ALINA_MAX_BURST + next], &p, out + heads[i], 1);
+        }
+        ++next;
+    }
+
+    void reset(size_t head) override {
+        h[std::find(heads.begin(), heads.end(), head) - heads.begin()] = 0;
+    }
+
+    size_t lower_count() const override {
+        size_t ans = 0;
+        for (size_t i = 0; i < lower.size(); ++i) {
+            ans += lower[i] == i;
+        }
+        return ans;
+    }
+
+    std::vector<std::shared_ptr<M>> nets;
+    // Sparse models are evaluated separately, without sharing lower layers
+    std::vector<std::shared_ptr<SparseModel<M>>> sparse;
+    // Head whose lower layers are evaluated for each head
+    std::vector<size_t> lower;
+    // Index of each head in the multi stream
+    std::vector<size_t> heads;
+    // Frames of the burst, outputs of the lower layers of head i are features[i * ALINA_MAX_BURST + t]
+    std::array<typename M::Input, ALINA_MAX_BURST> x;
+    std::vector<typename M::Features> features;
+    // Frame of the burst evaluated by the next step
+    size_t next = 0;
+    std::vector<typename M::State> h;
+};
+
+struct alina_multi_stream {
+    std::vector<std::unique_ptr<HeadGroup>> groups;
+    // Group of every head
+    std::vector<HeadGroup *> heads;
+};
+
+// Weights of any architecture behind the C API
+struct alina_model {
+    virtual ~alina_model() = default;
+
+    virtual const char *architecture() const = 0;
+
+    virtual float apply_to(const float *arr, size_t s, float *out) const = 0;
+
+    virtual bool save(const char *name) const = 0;
+
+    virtual float cost() const = 0;
+
+    virtual float speedup() const = 0;
+
+    virtual alina_stream *create_stream(size_t capacity) const = 0;
+
+    virtual std::unique_ptr<HeadGroup> create_group() const = 0;
+};
+
+template<class M>
+struct ModelOf : alina_model {
+    explicit ModelOf(std::shared_ptr<M> net): net(std::move(net)), sparse(compile_sparse(*this->net)) {}
+
+    const char *architecture() const override {
+        return architecture_name<M>;
+    }
+
+    float apply_to(const float *arr, size_t s, float *out) const override {
+        return sparse ? sparse->apply_to(arr, s, out) : net->apply_to(arr, s, out);
+    }
+
+    bool save(const char *name) const override {
+        return net->save(name);
+    }
+
+    float cost() const override {
+        return sparse ? (float) sparse->cost() / M::multiplications() : 1;
+    }
+
+    float speedup() const override {
+        return sparse ? sparse->speedup : 1;
+    }
+
+    alina_stream *create_stream(size_t capacity) const override {
+        return new StreamOf<M>(net, sparse, capacity);
+    }
+
+    std::unique_ptr<HeadGroup> create_group() const override {
+        return std::make_unique<HeadGroupOf<M>>();
+    }
+
+    std::shared_ptr<M> net;
+    std::shared_ptr<SparseModel<M>> sparse;
+};
+
+// Trainer of any architecture behind the functions of alina_net.hpp
+struct Trainer {
+    virtual ~Trainer() = default;
+
+    virtual bool freeze_lower(const char *name) = 0;
+
+    virtual void prune(float neurons, float blocks) = 0;
+
+    virtual void shuffle(std::vector<size_t> &order) = 0;
+
+    virtual void train_epoch(const Dataset &data, const std::vector<size_t> &order, size_t seq, float *losses) = 0;
+
+    virtual void train_epoch_from(size_t n, size_t seq, float *losses, const Sampler &next) = 0;
+
+    virtual alina_model *snapshot() = 0;
+};
+
+template<class M>
+struct TrainerOf : Trainer, BasicTrainer<M> {
+    static_assert(M::input_size == code_size);
+
+    using BasicTrainer<M>::BasicTrainer;
+
+    bool freeze_lower(const char *name) override {
+        return BasicTrainer<M>::freeze_lower(name);
+    }
+
+    void prune(float neurons, float blocks) override {
+        BasicTrainer<M>::prune(neurons, blocks);
+    }
+
+    void shuffle(std::vector<size_t> &order) override {
+        std::shuffle(order.begin(), order.end(), this->rnd);
+    }
+
+    void train_epoch(const Dataset &data, const std::vector<size_t> &order, size_t seq, float *losses) override {
+        this->train_on(order.size(), seq, losses, [&](size_t i) { return &data[order[i]]; });
+    }
+
+    void train_epoch_from(size_t n, size_t seq, float *losses, const Sampler &next) override {
+        if (n == 0) {
+            n = std::numeric_limits<size_t>::max();
+        }
+        Dataset series(seq);
+        this->train_on(n, seq, losses, [&](size_t i) {
+            auto &sample = series[i % seq];
+            return next(sample.first, sample.second) ? &sample : nullptr;
+        });
+    }
+
+    alina_model *snapshot() override {
+        return new ModelOf<M>(std::make_shared<M>(this->net));
+    }
+};
+
+// State of init, train_epoch and the other functions without a trainer argument
+TrainerOf<Net> trainer;
+Net &net = trainer.net;
+
+Dataset dataset;
+
+float apply_once(const Net::Input &x, Net::State &h) {
+    return net.apply_once(x, h);
+}
+
+
+void train_epoch_from(size_t n, size_t seq, float *losses, const Sampler &next) {
+    trainer_train_epoch_from(&trainer, n, seq, losses, next);
+}
+
+std::vector<const char *> architectures() {
+    std::vector<const char *> ans;
+    for_each_architecture([&ans](auto type) {
+        ans.emplace_back(architecture_name<typename decltype(type)::type>);
+        return false;
+    });
+    return ans;
+}
+
+Trainer *trainer_create(uint32_t seed, float lr, float positive_weight, const char *architecture) {
+    Trainer *ans = nullptr;
+    for_each_architecture([&](auto type) {
+        using M = typename decltype(type)::type;
+        if (strcmp(architecture, architecture_name<M>)) {
+            return false;
+        }
+        ans = new TrainerOf<M>(seed, lr, positive_weight);
+        return true;
+    });
+    return ans;
+}
+
+void trainer_free(Trainer *t) {
+    delete t;
+}
+
+bool trainer_freeze_lower(Trainer *t, const char *name) {
+    return t->freeze_lower(name);
+}
+
+void trainer_prune(Trainer *t, float neurons, float blocks) {
+    t->prune(neurons, blocks);
+}
+
+void trainer_shuffle(Trainer *t, std::vector<size_t> &order) {
+    t->shuffle(order);
+}
+
+void trainer_train_epoch(Trainer *t, const Dataset &data, const std::vector<size_t> &order, size_t seq, float *losses) {
+    t->train_epoch(data, order, seq, losses);
+}
+
+void trainer_train_epoch_from(Trainer *t, size_t n, size_t seq, float *losses, const Sampler &next) {
+    t->train_epoch_from(n, seq, losses, next);
+}
+
+alina_model *trainer_snapshot(Trainer *t) {
+    return t->snapshot();
 }
 
 extern "C" {
 
 void init(uint32_t seed) {
-    rnd.seed(seed);
-    delete opt;
-    opt = new RMSPropOptimizer<float>(1e-3);
-    cell.register_in_optimizer(*opt);
-    l1.register_in_optimizer(*opt);
-    l2.register_in_optimizer(*opt);
-    l3.register_in_optimizer(*opt);
-    l4.register_in_optimizer(*opt);
-    l5.register_in_optimizer(*opt);
-    l6.register_in_optimizer(*opt);
-    cell = GRUCell<float, linear_size, hidden_size, true>(frand);
-    l1 = Linear<float, code_size, linear_size, true>(frand);
-    l2 = Linear<float, linear_size, linear_size, true>(frand);
-    l3 = Linear<float, linear_size, linear_size, true>(frand);
-    l4 = Linear<float, hidden_size, linear_size, true>(frand);
-    l5 = Linear<float, linear_size, linear_size, true>(frand);
-    l6 = Linear<float, linear_size, 2, true>(frand);
+    trainer.init(seed, 1e-3, 100);
     dataset.clear();
 }
 
+bool freeze_lower(const char *name) {
+    return trainer.freeze_lower(name);
+}
+
 void add_data(float *arr, size_t s, bool y) {
-    std::vector<Tensor<float, code_size>> x(s);
+    std::vector<Net::Input> x(s);
     for (size_t i = 0; i < s; ++i) {
-        memcpy(x[i].data(), arr + i * code_size, sizeof(x[i]));
+        memcpy(x[i].data(), arr + i * Net::input_size, sizeof(x[i]));
     }
     dataset.emplace_back(std::move(x), y);
 }
 
 void shuffle() {
-    std::shuffle(dataset.begin(), dataset.end(), rnd);
+    std::shuffle(dataset.begin(), dataset.end(), trainer.rnd);
 }
 
 void train_epoch(size_t n, size_t seq, float *losses) {
-    exe = new StaticExecuter<THREADS>;
     if (n == 0) {
         n = dataset.size();
     }
-    GradientCalculator calc;
-    alloc.reset();
-    Variable h(*alloc.allocate<hidden_size>(), *alloc.allocate<hidden_size>());
-    Tensor<float> l(0), l_(0);
-    Variable var_l(l, l_);
-    int cnt = 0;
-    for (size_t i = 0; i < n; ++i) {
-        if (i % seq == 0) {
-            alloc.reset();
-            opt->zero_grad();
-            h = Variable(*alloc.allocate<hidden_size>(), *alloc.allocate<hidden_size>());
-            l = 0;
-            cnt = 0;
-        }
-        auto &X = dataset[i].first;
-        auto y = dataset[i].second;
-        for (size_t j = 0; j < X.size(); ++j) {
-            auto &x = X[j];
-            Variable o1(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable o1r(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable o2(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable o2r(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable o3(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable o3r(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-            Variable new_h(*alloc.allocate<hidden_size>(), *alloc.allocate<hidden_size>());
-            l1(x, o1, calc, *exe);
-            calc.relu(o1, o1r, *exe);
-            l2(o1r, o2, calc, *exe);
-            calc.relu(o2, o2r, *exe);
-            l3(o2r, o3, calc, *exe);
-            calc.relu(o3, o3r, *exe);
-            cell(o3r, h, new_h, calc, alloc, *exe);
-            h = new_h;
-            if (!y || j + 50 >= X.size()) {
-                Variable o4(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-                Variable o4r(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-                Variable o5(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-                Variable o5r(*alloc.allocate<linear_size>(), *alloc.allocate<linear_size>());
-                Variable o6(*alloc.allocate<2>(), *alloc.allocate<2>());
-                l4(h, o4, calc, *exe);
-                calc.relu(o4, o4r, *exe);
-                l5(o4r, o5, calc, *exe);
-                calc.relu(o5, o5r, *exe);
-                l6(o5r, o6, calc, *exe);
-                ++cnt;
-                // std::cout << *o6[0].data << " " << *o6[1].data << "\n";
-                add_cross_entropy_loss(o6, y, y ? 100 : 1, var_l, calc, *exe);
-            }
+    trainer.train_on(n, seq, losses, [](size_t i) { return &dataset[i]; });
+}
+
+float apply_to(float *arr, size_t s, float *out) {
+    return net.apply_to(arr, s, out);
+}
+
+void prune(float neurons, float blocks) {
+    trainer.prune(neurons, blocks);
+}
+
+void save_to_file(const char *name) {
+    net.save(name);
+}
+
+bool load_from_file(const char *name) {
+    return net.load(name);
+}
+
+alina_model *alina_model_load(const char *name) {
+    std::error_code err;
+    auto size = std::filesystem::file_size(name, err);
+    alina_model *ans = nullptr;
+    for_each_architecture([&](auto type) {
+        using M = typename decltype(type)::type;
+        if (err || size != M::file_size()) {
+            return false;
         }
-        if (i % seq == (seq - 1)) {
-            Variable mean_l(*alloc.allocate<>(), *alloc.allocate<>());
-            if (cnt) {
-                calc.apply_func(var_l, mean_l, [cnt](auto sum, auto &mean) {
-                    mean += sum / cnt;
-                }, [cnt](auto, auto, auto &sum_, auto mean_) {
-                    sum_ += mean_ / cnt;
-                });
-            }
-            calc.backward(mean_l);
-            *losses++ = l / cnt;
-            opt->step();
+        auto net = std::make_shared<M>();
+        if (net->load(name)) {
+            ans = new ModelOf<M>(std::move(net));
         }
+        return true;
+    });
+    return ans;
+}
+
+alina_model *alina_model_snapshot() {
+    return trainer.snapshot();
+}
+
+const char *alina_model_architecture(const alina_model *model) {
+    return model->architecture();
+}
+
+int alina_model_save(const alina_model *model, const char *name) {
+    return !model->save(name);
+}
+
+float alina_model_apply_to(const alina_model *model, const float *arr, size_t s, float *out) {
+    return model->apply_to(arr, s, out);
+}
+
+float alina_model_cost(const alina_model *model) {
+    return model->cost();
+}
+
+float alina_model_speedup(const alina_model *model) {
+    return model->speedup();
+}
+
+void alina_model_free(alina_model *model) {
+    delete model;
+}
+
+alina_stream *alina_stream_create(const alina_model *model, size_t capacity) {
+    return model->create_stream(capacity);
+}
+
+size_t alina_stream_push(alina_stream *stream, const float *frames, size_t n) {
+    size_t pushed = 0;
+    for (; pushed < n && stream->count < stream->probs.size(); ++pushed) {
+        stream->push(frames + pushed * ALINA_CODE_SIZE);
     }
-    delete exe;
+    return pushed;
 }
 
-float apply_to(float *arr, size_t s, float *out) {
-    Tensor<float, code_size> x;
-    Tensor<float, hidden_size> h(0);
-    float ans = 0;
-    for (size_t i = 0; i < s; ++i) {
-        memcpy(x.data(), arr + i * code_size, sizeof(x));
-        Tensor<float, linear_size> o1, o2, o3, o4, o5;
-        Tensor<float, 2> o6;
-        Tensor<float, hidden_size> nh;
-        l1.no_grad()(x, o1);
-        relu(o1, o1);
-        l2.no_grad()(o1, o2);
-        relu(o2, o2);
-        l3.no_grad()(o2, o3);
-        relu(o3, o3);
-        cell.no_grad()(o3, h, nh);
-        h = nh;
-        l4.no_grad()(h, o4);
-        relu(o4, o4);
-        l5.no_grad()(o4, o5);
-        relu(o5, o5);
-        l6.no_grad()(o5, o6);
-        // float mx = *std::max_element(o6.begin(), o6.end());
-        float mx = *std::max_element(o6.begin(), o6.end());
-        o6[0] -= mx;
-        o6[1] -= mx;
-        exp(o6, o6);
-        if (out) {
-            *out++ = o6[1] / (o6[0] + o6[1]);
+size_t alina_stream_read(alina_stream *stream, float *out, size_t n) {
+    n = std::min(n, stream->count);
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = stream->probs[stream->head];
+        stream->head = (stream->head + 1) % stream->probs.size();
+    }
+    stream->count -= n;
+    return n;
+}
+
+void alina_stream_reset(alina_stream *stream) {
+    stream->reset_state();
+    stream->head = stream->count = 0;
+}
+
+void alina_stream_push_batch(alina_stream *const *streams, const float *frames, size_t n) {
+    if (n) {
+        streams[0]->push_batch(streams, frames, n);
+    }
+}
+
+void alina_stream_free(alina_stream *stream) {
+    delete stream;
+}
+
+alina_multi_stream *alina_multi_stream_create(const alina_model *const *models, size_t n) {
+    auto stream = new alina_multi_stream;
+    for (size_t i = 0; i < n; ++i) {
+        auto group = std::find_if(stream->groups.begin(), stream->groups.end(), [&](auto &g) {
+            return g->add(models[i], i);
+        });
+        if (group == stream->groups.end()) {
+            stream->groups.emplace_back(models[i]->create_group());
+            stream->groups.back()->add(models[i], i);
+            group = stream->groups.end() - 1;
         }
-        ans = std::max(ans, o6[1] / (o6[0] + o6[1]));
+        stream->heads.emplace_back(group->get());
+    }
+    return stream;
+}
+
+size_t alina_multi_stream_lower_count(const alina_multi_stream *stream) {
+    size_t ans = 0;
+    for (auto &g : stream->groups) {
+        ans += g->lower_count();
     }
     return ans;
 }
 
-void save_to_file(const char *name) {
-    std::ofstream out(name, std::ios::out | std::ios::binary);
-    out.write(reinterpret_cast<char *>(l1.W.data()), sizeof(l1.W));
-    out.write(reinterpret_cast<char *>(l1.b.data()), sizeof(l1.b));
-    out.write(reinterpret_cast<char *>(l2.W.data()), sizeof(l2.W));
-    out.write(reinterpret_cast<char *>(l2.b.data()), sizeof(l2.b));
-    out.write(reinterpret_cast<char *>(l3.W.data()), sizeof(l3.W));
-    out.write(reinterpret_cast<char *>(l3.b.data()), sizeof(l3.b));
-    out.write(reinterpret_cast<char *>(l4.W.data()), sizeof(l4.W));
-    out.write(reinterpret_cast<char *>(l4.b.data()), sizeof(l4.b));
-    out.write(reinterpret_cast<char *>(l5.W.data()), sizeof(l5.W));
-    out.write(reinterpret_cast<char *>(l5.b.data()), sizeof(l5.b));
-    out.write(reinterpret_cast<char *>(l6.W.data()), sizeof(l6.W));
-    out.write(reinterpret_cast<char *>(l6.b.data()), sizeof(l6.b));
-
-    out.write(reinterpret_cast<char *>(cell.Wr.data()), sizeof(cell.Wr));
-    out.write(reinterpret_cast<char *>(cell.Ur.data()), sizeof(cell.Ur));
-    out.write(reinterpret_cast<char *>(cell.br.data()), sizeof(cell.br));
-    out.write(reinterpret_cast<char *>(cell.Wz.data()), sizeof(cell.Wz));
-    out.write(reinterpret_cast<char *>(cell.Uz.data()), sizeof(cell.Uz));
-    out.write(reinterpret_cast<char *>(cell.bz.data()), sizeof(cell.bz));
-    out.write(reinterpret_cast<char *>(cell.Wh.data()), sizeof(cell.Wh));
-    out.write(reinterpret_cast<char *>(cell.Uh.data()), sizeof(cell.Uh));
-    out.write(reinterpret_cast<char *>(cell.bh.data()), sizeof(cell.bh));
-}
-
-void load_from_file(const char *name) {
-    std::ifstream in(name, std::ios::in | std::ios::binary);
-    in.read(reinterpret_cast<char *>(l1.W.data()), sizeof(l1.W));
-    in.read(reinterpret_cast<char *>(l1.b.data()), sizeof(l1.b));
-    in.read(reinterpret_cast<char *>(l2.W.data()), sizeof(l2.W));
-    in.read(reinterpret_cast<char *>(l2.b.data()), sizeof(l2.b));
-    in.read(reinterpret_cast<char *>(l3.W.data()), sizeof(l3.W));
-    in.read(reinterpret_cast<char *>(l3.b.data()), sizeof(l3.b));
-    in.read(reinterpret_cast<char *>(l4.W.data()), sizeof(l4.W));
-    in.read(reinterpret_cast<char *>(l4.b.data()), sizeof(l4.b));
-    in.read(reinterpret_cast<char *>(l5.W.data()), sizeof(l5.W));
-    in.read(reinterpret_cast<char *>(l5.b.data()), sizeof(l5.b));
-    in.read(reinterpret_cast<char *>(l6.W.data()), sizeof(l6.W));
-    in.read(reinterpret_cast<char *>(l6.b.data()), sizeof(l6.b));
-
-    in.read(reinterpret_cast<char *>(cell.Wr.data()), sizeof(cell.Wr));
-    in.read(reinterpret_cast<char *>(cell.Ur.data()), sizeof(cell.Ur));
-    in.read(reinterpret_cast<char *>(cell.br.data()), sizeof(cell.br));
-    in.read(reinterpret_cast<char *>(cell.Wz.data()), sizeof(cell.Wz));
-    in.read(reinterpret_cast<char *>(cell.Uz.data()), sizeof(cell.Uz));
-    in.read(reinterpret_cast<char *>(cell.bz.data()), sizeof(cell.bz));
-    in.read(reinterpret_cast<char *>(cell.Wh.data()), sizeof(cell.Wh));
-    in.read(reinterpret_cast<char *>(cell.Uh.data()), sizeof(cell.Uh));
-    in.read(reinterpret_cast<char *>(cell.bh.data()), sizeof(cell.bh));
+void alina_multi_stream_push(alina_multi_stream *stream, const float *frame, float *out) {
+    alina_multi_stream_push_lower(stream, frame, 1);
+    alina_multi_stream_step(stream, out);
+}
+
+void alina_multi_stream_push_lower(alina_multi_stream *stream, const float *frames, size_t n) {
+    for (auto &g : stream->groups) {
+        g->push_lower(frames, n);
+    }
+}
+
+void alina_multi_stream_step(alina_multi_stream *stream, float *out) {
+    for (auto &g : stream->groups) {
+        g->step(out);
+    }
+}
+
+void alina_multi_stream_reset(alina_multi_stream *stream, size_t head) {
+    stream->heads[head]->reset(head);
+}
+
+void alina_multi_stream_free(alina_multi_stream *stream) {
+    delete stream;
 }
 
 };
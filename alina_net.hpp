@@ -1,16 +1,62 @@
 #pragma once
 
 #include <cinttypes>
+#include <functional>
+#include <vector>
+#include <utility>
 #include "fastrnn/tensor.hpp"
+#include "alina_api.h"
 
 constexpr size_t code_size = 40, hidden_size = 128, linear_size = 128;
 
 float apply_once(const fastrnn::Tensor<float, code_size> &x, fastrnn::Tensor<float, hidden_size> &h);
 
+// Fills the next training sample and returns false when the epoch is over
+using Sampler = std::function<bool(std::vector<fastrnn::Tensor<float, code_size>> &x, bool &y)>;
+
+// Same as train_epoch, but takes samples from next instead of the stored dataset.
+// If n is 0, trains until next returns false.
+void train_epoch_from(size_t n, size_t seq, float *losses, const Sampler &next);
+
+using Dataset = std::vector<std::pair<std::vector<fastrnn::Tensor<float, code_size>>, bool>>;
+
+// Training state separate from the one used by the functions above. Trainers share nothing,
+// so several configurations can be trained concurrently, each in its own thread.
+struct Trainer;
+
+// Names of the architectures trainers can be created for, the first one is used by the functions above
+std::vector<const char *> architectures();
+
+// positive_weight is the loss weight of positive samples, negative ones have 1.
+// Returns nullptr if there is no such architecture.
+Trainer *trainer_create(uint32_t seed, float lr, float positive_weight, const char *architecture);
+
+void trainer_free(Trainer *trainer);
+
+// Returns false if the model can't be loaded or has another architecture than the trainer
+bool trainer_freeze_lower(Trainer *trainer, const char *name);
+
+void trainer_prune(Trainer *trainer, float neurons, float blocks);
+
+// Shuffles with the random generator of the trainer, like shuffle does with the dataset
+void trainer_shuffle(Trainer *trainer, std::vector<size_t> &order);
+
+// Trains on data[order[0]], data[order[1]], ... The data is only read, so trainers can share it.
+void trainer_train_epoch(Trainer *trainer, const Dataset &data, const std::vector<size_t> &order, size_t seq, float *losses);
+
+void trainer_train_epoch_from(Trainer *trainer, size_t n, size_t seq, float *losses, const Sampler &next);
+
+alina_model *trainer_snapshot(Trainer *trainer);
+
 extern "C" {
 
 void init(uint32_t seed);
 
+// Takes l1..l3 from the model in file name and excludes them from training, so models
+// for different keywords trained this way share the lower layers in alina_multi_stream.
+// Returns false if the model can't be loaded or has another architecture.
+bool freeze_lower(const char *name);
+
 void add_data(float *arr, size_t s, bool y);
 
 void shuffle();
@@ -19,8 +65,14 @@ void train_epoch(size_t n, size_t seq, float *losses);
 
 float apply_to(float *arr, size_t s, float *out);
 
+// Zeroes the fraction neurons of neurons (in groups of 4) with the smallest weights in every layer
+// and then the fraction blocks of 4x4 weight blocks in every matrix. Pruned weights stay zero in
+// the following training. Call with growing fractions to prune gradually. Fractions must be from 0 to 1.
+void prune(float neurons, float blocks);
+
 void save_to_file(const char *name);
 
-void load_from_file(const char *name);
+// Returns false if the file can't be read or has weights of another architecture
+bool load_from_file(const char *name);
 
 };
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <cinttypes>
+#include <nlohmann/json.hpp>
+#include "features.hpp"
+#include "fastrnn/tensor.hpp"
+
+// Part of a recording used as a training sample
+struct Clip {
+    size_t file, begin, end;
+    size_t padding; // silent frames appended after the clip
+};
+
+struct AugmentationConfig {
+    std::vector<std::string> noise;
+    float noise_prob;
+    std::pair<float, float> snr_db, gain_db, speed;
+    size_t max_shift;
+    size_t producers, queue_size;
+
+    explicit AugmentationConfig(const nlohmann::json &j):
+        noise(j.value("noise", std::vector<std::string>())),
+        noise_prob(j.value("noise_prob", 0.5f)),
+        snr_db(j.value("snr_db", std::pair(5.0f, 20.0f))),
+        gain_db(j.value("gain_db", std::pair(-6.0f, 6.0f))),
+        speed(j.value("speed", std::pair(0.9f, 1.1f))),
+        max_shift(j.value("shift_ms", 100) * SAMPLE_RATE / 1000),
+        producers(j.value("producers", 2)),
+        queue_size(j.value("queue_size", 64)) {
+        if (j.value("shift_ms", 0) < 0) {
+            throw std::invalid_argument("shift_ms must not be negative");
+        }
+        if (speed.first <= 0 || speed.first > speed.second) {
+            throw std::invalid_argument("speed must be a positive range");
+        }
+        if (producers == 0 || queue_size == 0) {
+            throw std::invalid_argument("producers and queue_size must be positive");
+        }
+    }
+};
+
+// Renders a randomly perturbed version of a clip and computes its features.
+// Noise, gain, time shift and speed are applied to the waveform, so nothing but the source recordings is stored.
+// The waveform is then clipped and quantized like captured audio.
+class Augmenter {
+public:
+    using Frame = fastrnn::Tensor<float, FREQ_TO - FREQ_FROM>;
+
+    Augmenter(const AugmentationConfig &config, const std::vector<std::vector<float>> &recordings, const std::vector<std::vector<float>> &noise):
+        config(config), recordings(recordings), noise(noise) {}
+
+    // wave is a scratch buffer, so a producer can reuse it between calls
+    void operator()(const Clip &clip, std::mt19937 &rnd, std::vector<float> &wave, std::vector<Frame> &out) const {
+        auto &src = recordings[clip.file];
+        long len = clip.end - clip.begin;
+        long shift = std::uniform_int_distribution<long>(-(long) config.max_shift, config.max_shift)(rnd);
+        long begin = std::clamp<long>((long) clip.begin + shift, 0, (long) src.size() - len);
+
+        float speed = std::uniform_real_distribution<float>(config.speed.first, config.speed.second)(rnd);
+        float gain = std::pow(10.0f, std::uniform_real_distribution<float>(config.gain_db.first, config.gain_db.second)(rnd) / 20);
+        wave.resize((len - 1) / speed + 1);
+        for (size_t i = 0; i < wave.size(); ++i) {
+            float pos = i * speed;
+            size_t j = pos;
+            float t = pos - j;
+            float next = j + 1 < (size_t) len ? src[begin + j + 1] : src[begin + j];
+            wave[i] = (src[begin + j] * (1 - t) + next * t) * gain;
+        }
+
+        if (!noise.empty() && std::bernoulli_distribution(config.noise_prob)(rnd)) {
+            auto &n = noise[rnd() % noise.size()];
+            size_t offset = rnd() % n.size();
+            float signal_power = 0, noise_power = 0;
+            for (size_t i = 0; i < wave.size(); ++i) {
+                signal_power += wave[i] * wave[i];
+                float x = n[(offset + i) % n.size()];
+                noise_power += x * x;
+            }
+            float snr = std::uniform_real_distribution<float>(config.snr_db.first, config.snr_db.second)(rnd);
+            if (noise_power > 1e-9) {
+                float k = std::sqrt(signal_power / (noise_power * std::pow(10.0f, snr / 10)));
+                for (size_t i = 0; i < wave.size(); ++i) {
+                    wave[i] += n[(offset + i) % n.size()] * k;
+                }
+            }
+        }
+
+        // Features are normalized per frame, so gain alone would cancel. What it changes on the device
+        // is clipping and the int16 quantization of quiet speech, which the capture path applies here.
+        for (auto &x : wave) {
+            x = std::round(std::clamp(x, -1.0f, 1.0f) * std::numeric_limits<int16_t>::max()) / std::numeric_limits<int16_t>::max();
+        }
+
+        size_t frames = spectrogram_size(wave.size());
+        out.resize(frames + clip.padding);
+        spectrogram<FREQ_FROM, FREQ_TO>(wave.begin(), wave.end(), out.begin());
+        for (size_t i = 0; i < frames; ++i) {
+            normalize(out[i]);
+        }
+        for (size_t i = frames; i < out.size(); ++i) {
+            out[i] = 0;
+        }
+    }
+private:
+    const AugmentationConfig &config;
+    const std::vector<std::vector<float>> &recordings, &noise;
+};
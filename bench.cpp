@@ -0,0 +1,163 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cinttypes>
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+#include <AudioFile.h>
+#include "features.hpp"
+#include "detector.hpp"
+#include "alina_api.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Runs the detection loop of main over the recordings of a dataset in the format read by train.
+// Every rising edge of the detection is an event. On positive recordings an event matches the
+// first unmatched region ending at most tolerance before it, other events are false alarms.
+int main(int argc, char **argv) {
+    float tolerance_ms = 1000, period_ms = 0;
+    for (int opt; (opt = getopt(argc, argv, "t:d:")) != -1;) {
+        switch (opt) {
+        case 't':
+            tolerance_ms = atof(optarg);
+            break;
+        case 'd':
+            period_ms = atof(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 4) {
+        cerr << "Specify dataset directory, weights file and treshold\n";
+        cerr << "Options: -t ms after the end of a region when the keyword still counts as detected,\n";
+        cerr << "-d feed audio in bursts of given ms like main -d\n";
+        return 1;
+    }
+    auto model = alina_model_load(argv[2]);
+    if (!model) {
+        cerr << "Can't load " << argv[2] << "\n";
+        return 1;
+    }
+    float treshold = atof(argv[3]);
+    const size_t tolerance = tolerance_ms * SAMPLE_RATE / 1000;
+    const size_t chunk = max<size_t>(WINDOW_SIZE / 2, period_ms * SAMPLE_RATE / 1000);
+
+    auto meta = nlohmann::json::parse(ifstream(string(argv[1]) + "meta.json"));
+    size_t positive_samples = 0, negative_samples = 0;
+    size_t false_alarms = 0, false_alarms_on_positives = 0, regions = 0, misses = 0;
+    vector<float> latencies;
+    Clock::duration wall{};
+    clock_t cpu = 0;
+    for (auto &x : meta.items()) {
+        bool positive = x.key().substr(0, 3) == "pos";
+        for (auto &file_meta : x.value()) {
+            AudioFile<float> file;
+            file.load(string(argv[1]) + "/" + file_meta["path"].get<string>());
+            if (file.getSampleRate() != SAMPLE_RATE) {
+                cerr << "Sample rate of " << file_meta["path"] << " must be " << SAMPLE_RATE << "\n";
+                return 1;
+            }
+            vector<int16_t> audio;
+            audio.reserve(file.samples[0].size());
+            for (auto s : file.samples[0]) {
+                audio.emplace_back(clamp(s, -1.0f, 1.0f) * numeric_limits<int16_t>::max());
+            }
+            vector<pair<size_t, size_t>> file_regions;
+            if (positive) {
+                if (file_meta["regions"].is_null()) {
+                    // Split like train does, a file without pauses is a single utterance
+                    for (auto [begin, end] : split_utterances(full_spectrogram(file.samples[0]))) {
+                        file_regions.emplace_back(begin * (WINDOW_SIZE / 2), end * (WINDOW_SIZE / 2) + WINDOW_SIZE);
+                    }
+                    if (file_regions.empty()) {
+                        file_regions.emplace_back(0, audio.size());
+                    }
+                } else {
+                    for (auto &reg : file_meta["regions"]) {
+                        file_regions.emplace_back(reg[0].get<size_t>(), reg[1].get<size_t>());
+                    }
+                }
+            }
+            (positive ? positive_samples : negative_samples) += audio.size();
+
+            // Events are timed by the end of the chunk they were detected in
+            vector<size_t> events;
+            Detector detector({model}, {treshold});
+            bool prev_detected = false;
+            auto wall_start = Clock::now();
+            auto cpu_start = clock();
+            for (size_t pos = 0; pos < audio.size(); pos += chunk) {
+                size_t n = min(chunk, audio.size() - pos);
+                detector.push(audio.data() + pos, n, [&](auto &, auto &detected) {
+                    if (detected[0] && !prev_detected) {
+                        events.emplace_back(pos + n);
+                    }
+                    prev_detected = detected[0];
+                });
+            }
+            cpu += clock() - cpu_start;
+            wall += Clock::now() - wall_start;
+
+            vector<bool> matched(file_regions.size());
+            for (auto t : events) {
+                size_t i = 0;
+                while (i < file_regions.size() && (matched[i] || t < file_regions[i].first || t > file_regions[i].second + tolerance)) {
+                    ++i;
+                }
+                if (i < file_regions.size()) {
+                    matched[i] = true;
+                    latencies.emplace_back(((float) t - file_regions[i].second) * 1000 / SAMPLE_RATE);
+                } else {
+                    ++(positive ? false_alarms_on_positives : false_alarms);
+                }
+            }
+            regions += file_regions.size();
+            misses += count(matched.begin(), matched.end(), false);
+        }
+    }
+    float relative_cost = alina_model_cost(model), speedup = alina_model_speedup(model);
+    string architecture = alina_model_architecture(model);
+    alina_model_free(model);
+
+    const float HOUR = 3600.0f * SAMPLE_RATE;
+    float audio_hours = (positive_samples + negative_samples) / HOUR;
+    float wall_seconds = chrono::duration<float>(wall).count();
+    float cpu_seconds = (float) cpu / CLOCKS_PER_SEC;
+    nlohmann::json report;
+    report["architecture"] = architecture;
+    report["audio_hours"] = audio_hours;
+    report["negative_hours"] = negative_samples / HOUR;
+    report["wall_seconds"] = wall_seconds;
+    report["cpu_seconds"] = cpu_seconds;
+    report["real_time_factor"] = audio_hours ? wall_seconds / (audio_hours * 3600) : 0;
+    report["cpu_seconds_per_audio_hour"] = audio_hours ? cpu_seconds / audio_hours : 0;
+    report["relative_cost"] = relative_cost;
+    report["sparse_speedup"] = speedup;
+    report["false_alarms"] = false_alarms;
+    report["false_alarms_per_hour"] = negative_samples ? false_alarms / (negative_samples / HOUR) : 0;
+    report["false_alarms_on_positives"] = false_alarms_on_positives;
+    report["positives"] = regions;
+    report["misses"] = misses;
+    report["miss_rate"] = regions ? (float) misses / regions : 0;
+    // Milliseconds from the end of a region to the detection, negative if detected before the end
+    auto latency = nlohmann::json::object();
+    if (!latencies.empty()) {
+        sort(latencies.begin(), latencies.end());
+        latency["mean"] = accumulate(latencies.begin(), latencies.end(), 0.0f) / latencies.size();
+        latency["median"] = latencies[latencies.size() / 2];
+        latency["p95"] = latencies[latencies.size() * 95 / 100];
+        latency["max"] = latencies.back();
+    }
+    report["latency_ms"] = latency;
+    cout << report.dump() << "\n";
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template<class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity): capacity(capacity) {}
+
+    void push(T x) {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.emplace_back(std::move(x));
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    T pop() {
+        std::unique_lock lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty(); });
+        T x = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return x;
+    }
+private:
+    size_t capacity;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+};
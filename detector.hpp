@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <cinttypes>
+#include <algorithm>
+#include "features.hpp"
+#include "alina_api.h"
+
+// Keyword detection loop shared by main and bench. A model is reset when its probability
+// falls below the treshold after a detection.
+class Detector {
+public:
+    Detector(const std::vector<alina_model *> &models, std::vector<float> tresholds):
+        stream(alina_multi_stream_create(models.data(), models.size())),
+        tresholds(std::move(tresholds)), res(models.size()), detected(models.size()) {
+        frames.reserve(SAMPLE_RATE / (WINDOW_SIZE / 2));
+    }
+    Detector(const Detector &) = delete;
+    Detector &operator=(const Detector &) = delete;
+    ~Detector() {
+        alina_multi_stream_free(stream);
+    }
+
+    size_t lower_count() const {
+        return alina_multi_stream_lower_count(stream);
+    }
+
+    // Frames of the pushed samples are computed first. The lower layers are evaluated for up to
+    // ALINA_MAX_BURST of them at once, the GRU and the upper layers frame by frame.
+    // on_result(probabilities, detected) is called for every hop.
+    template<class F>
+    void push(const int16_t *p, size_t n, F &&on_result) {
+        frames.clear();
+        features.push(p, n, [this](auto &spect) {
+            frames.emplace_back(spect);
+        });
+        static_assert(sizeof(FeatureExtractor::Frame) == ALINA_CODE_SIZE * sizeof(float));
+        for (size_t from = 0; from < frames.size(); from += ALINA_MAX_BURST) {
+            size_t m = std::min<size_t>(ALINA_MAX_BURST, frames.size() - from);
+            alina_multi_stream_push_lower(stream, frames[from].data(), m);
+            for (size_t t = 0; t < m; ++t) {
+                alina_multi_stream_step(stream, res.data());
+                for (size_t k = 0; k < res.size(); ++k) {
+                    auto prev_detected = detected[k];
+                    detected[k] = res[k] > tresholds[k];
+                    if (!detected[k] && prev_detected) {
+                        alina_multi_stream_reset(stream, k);
+                    }
+                }
+                on_result(res, detected);
+            }
+        }
+    }
+private:
+    alina_multi_stream *stream;
+    std::vector<float> tresholds;
+    FeatureExtractor features;
+    std::vector<FeatureExtractor::Frame> frames;
+    std::vector<float> res;
+    std::vector<bool> detected;
+};
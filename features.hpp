@@ -0,0 +1,142 @@
+#pragma once
+
+#include <complex>
+#include <numeric>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
+#include <cinttypes>
+#include <utility>
+#include <vector>
+#include "fft.hpp"
+#include "fastrnn/tensor.hpp"
+
+const unsigned SAMPLE_RATE = 16000;
+const unsigned WINDOW_SIZE = 128;
+const unsigned FREQ_FROM = 3, FREQ_TO = 43;
+
+template<unsigned freq_from, unsigned freq_to, class BidirIt, class OutIt>
+void spectrogram(BidirIt first, BidirIt last, OutIt out) {
+    static_assert(std::remove_reference<decltype(*out)>::type::static_size == freq_to - freq_from);
+    while (last - first > WINDOW_SIZE) {
+        fastrnn::Tensor<std::complex<float>, WINDOW_SIZE> window;
+        std::copy(first, first + WINDOW_SIZE, window.begin());
+        fft(window);
+        std::transform(window.begin() + freq_from, window.begin() + freq_to, out->begin(), [](auto &x) { return std::abs(*x.data()); });
+        ++out;
+        first += WINDOW_SIZE / 2;
+    }
+}
+
+template<class T>
+void normalize(T &x) {
+    auto s = std::accumulate(x.begin(), x.end(), 0.0f);
+    if (s < 1e-5)
+        s = 1e-5;
+    x /= s;
+}
+
+constexpr size_t spectrogram_size(size_t samples) {
+    return samples > WINDOW_SIZE ? (samples - WINDOW_SIZE - 1) / (WINDOW_SIZE / 2) + 1 : 0;
+}
+
+// Magnitudes of the frequencies below FREQ_TO for every hop of a recording
+template<class T>
+std::vector<fastrnn::Tensor<float, FREQ_TO>> full_spectrogram(const std::vector<T> &samples) {
+    std::vector<fastrnn::Tensor<float, FREQ_TO>> spect(std::max<size_t>(samples.size() / (WINDOW_SIZE / 2), 1) - 1);
+    spectrogram<0, FREQ_TO>(samples.begin(), samples.end(), spect.begin());
+    return spect;
+}
+
+// Power above which a frame is loud, from the 10th and the 90th percentiles
+inline float get_treshold(std::vector<float> powers) {
+    auto low = powers.begin() + powers.size() / 10;
+    auto high = powers.begin() + powers.size() / 10 * 9;
+    std::nth_element(powers.begin(), low, powers.end());
+    std::nth_element(powers.begin(), high, powers.end());
+    return *low + (*high - *low) * 0.2;
+}
+
+// Splits a recording of several utterances separated by pauses into ranges [begin, end) of
+// spectrogram frames. A range ends 10 quiet frames after an utterance and the next one starts there,
+// audio after the last utterance is not included. Recordings shorter than 110 frames are not split.
+inline std::vector<std::pair<size_t, size_t>> split_utterances(const std::vector<fastrnn::Tensor<float, FREQ_TO>> &spect) {
+    std::vector<std::pair<size_t, size_t>> ans;
+    if (spect.size() < 110) {
+        return ans;
+    }
+    std::vector<float> powers(spect.size());
+    std::transform(spect.begin(), spect.end(), powers.begin(), [](const auto &tensor) {
+        return std::accumulate(tensor.begin(), tensor.end(), 0.0f);
+    });
+    auto tres = get_treshold(powers);
+    int cur_sum = 0;
+    for (size_t i = 0; i < 100; ++i) {
+        cur_sum += (powers[i] > tres);
+    }
+    for (size_t i = 100; i < 110; ++i) {
+        cur_sum -= 100 * (powers[i] > tres);
+    }
+    size_t last = 0;
+    for (size_t i = 110; i < powers.size(); ++i) {
+        cur_sum -= 100 * (powers[i] > tres);
+        cur_sum += 101 * (powers[i - 10] > tres);
+        cur_sum -= (powers[i - 110] > tres);
+        if (cur_sum > 45 && i - last >= 70) {
+            ans.emplace_back(last, i);
+            last = i;
+        }
+    }
+    return ans;
+}
+
+// Streaming front-end of the detector. Windows of WINDOW_SIZE samples are taken with
+// WINDOW_SIZE / 2 hop and normalized so the mean magnitude is 1.
+class FeatureExtractor {
+public:
+    using Frame = fastrnn::Tensor<float, FREQ_TO - FREQ_FROM>;
+
+    // Calls on_frame for every completed hop
+    template<class F>
+    void push(const int16_t *p, size_t n, F &&on_frame) {
+        for (size_t i = 0; i < n; ++i) {
+            window[pos++] = (float) p[i] / std::numeric_limits<int16_t>::max();
+            if (pos == WINDOW_SIZE) {
+                if (primed) {
+                    auto frame = compute();
+                    on_frame(frame);
+                }
+                primed = true;
+                window.view<2, WINDOW_SIZE / 2>()[0] = window.view<2, WINDOW_SIZE / 2>()[1];
+                pos = WINDOW_SIZE / 2;
+            }
+        }
+    }
+
+    void reset() {
+        pos = 0;
+        primed = false;
+    }
+private:
+    Frame compute() const {
+        fastrnn::Tensor<std::complex<float>, WINDOW_SIZE> to_fft;
+        for (size_t i = 0; i < window.size(); ++i) {
+            to_fft[i] = std::complex<float>(window[i]);
+        }
+        fft(to_fft);
+        Frame spect;
+        for (size_t i = 0; i < spect.size(); ++i) {
+            spect[i] = std::abs((std::complex<float> &) to_fft[i + FREQ_FROM]);
+        }
+        float s = std::accumulate(spect.begin(), spect.end(), 0.0) / spect.size();
+        if (s < 1e-5) {
+            s = 1e-5;
+        }
+        spect /= s;
+        return spect;
+    }
+
+    fastrnn::Tensor<float, WINDOW_SIZE> window;
+    size_t pos = 0;
+    bool primed = false;
+};
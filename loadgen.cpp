@@ -0,0 +1,199 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
+#include <limits>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <nlohmann/json.hpp>
+#include <AudioFile.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Streams audio to the detection server from many connections at once and reports whether
+// the server keeps up with real time. Latency is measured from sending the chunk which completes
+// a hop to receiving the detection line of that hop, so only detected hops are timed. Run the
+// server with a negative treshold to time every hop.
+int main(int argc, char **argv) {
+    string socket_path = "/tmp/alina.sock", wav;
+    size_t streams = 100;
+    float seconds = 10, speed = 1;
+    for (int opt; (opt = getopt(argc, argv, "s:n:t:x:f:")) != -1;) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'n':
+            streams = strtoul(optarg, nullptr, 10);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'f':
+            wav = optarg;
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-s socket] [-n streams] [-t seconds] [-x speed] [-f wav file]\n";
+            return 1;
+        }
+    }
+
+    const unsigned SAMPLE_RATE = 16000;
+    const size_t CHUNK = SAMPLE_RATE / 100; // 10 ms
+    const size_t HOP = 64, WINDOW = 128; // hop i of the server ends with sample (i + 1) * HOP
+    vector<int16_t> audio;
+    if (!wav.empty()) {
+        AudioFile<float> file;
+        file.load(wav);
+        if (file.getSampleRate() != SAMPLE_RATE) {
+            cerr << "Sample rate must be " << SAMPLE_RATE << "\n";
+            return 1;
+        }
+        for (auto x : file.samples[0]) {
+            audio.emplace_back(clamp(x, -1.0f, 1.0f) * numeric_limits<int16_t>::max());
+        }
+    } else {
+        mt19937 rnd(1);
+        normal_distribution<float> noise(0, 1000);
+        audio.resize(SAMPLE_RATE * 10);
+        for (auto &x : audio) {
+            x = clamp(noise(rnd), -32767.0f, 32767.0f);
+        }
+    }
+    audio.resize(audio.size() / CHUNK * CHUNK);
+    if (audio.empty()) {
+        cerr << "Audio is too short\n";
+        return 1;
+    }
+
+    atomic<size_t> events = 0, failed = 0;
+    atomic<int64_t> max_lag_us = 0;
+    const size_t total = seconds * SAMPLE_RATE;
+    // Collected from all streams when they end
+    mutex stats_mutex;
+    vector<float> latencies;
+    size_t evaluated = 0, dropped = 0, streams_with_drops = 0, unfinished = 0;
+    float max_queue_delay_ms = 0;
+    auto start = Clock::now();
+    vector<thread> threads;
+    for (size_t k = 0; k < streams; ++k) {
+        threads.emplace_back([&, k] {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+            if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+                ++failed;
+                close(fd);
+                return;
+            }
+            // Streams start at different positions so they don't detect at the same time
+            size_t pos = k * CHUNK * 37 % audio.size();
+            auto begin = Clock::now();
+            int64_t lag = 0;
+            char buf[4096];
+            vector<Clock::time_point> sent_at;
+            sent_at.reserve(total / CHUNK + 1);
+            vector<float> stream_latencies;
+            string line;
+            bool finished = false;
+            size_t stream_evaluated = 0, stream_dropped = 0;
+            float stream_delay_ms = 0;
+            auto receive = [&](const char *p, ssize_t len) {
+                auto now = Clock::now();
+                for (ssize_t i = 0; i < len; ++i) {
+                    if (p[i] != '\n') {
+                        line += p[i];
+                        continue;
+                    }
+                    size_t hop;
+                    if (sscanf(line.c_str(), "end %zu %zu %f", &stream_evaluated, &stream_dropped, &stream_delay_ms) == 3) {
+                        finished = true;
+                    } else if (sscanf(line.c_str(), "%zu", &hop) == 1) {
+                        ++events;
+                        size_t chunk = ((hop - 1) * HOP + WINDOW - 1) / CHUNK;
+                        if (chunk < sent_at.size()) {
+                            stream_latencies.emplace_back(chrono::duration<float, milli>(now - sent_at[chunk]).count());
+                        }
+                    }
+                    line.clear();
+                }
+            };
+            for (size_t sent = 0; sent < total; sent += CHUNK) {
+                auto due = begin + chrono::duration_cast<Clock::duration>(chrono::duration<float>(sent / (SAMPLE_RATE * speed)));
+                pollfd p{fd, POLLIN, 0};
+                while (Clock::now() < due) {
+                    int timeout = chrono::duration_cast<chrono::milliseconds>(due - Clock::now()).count() + 1;
+                    if (poll(&p, 1, timeout) > 0) {
+                        receive(buf, read(fd, buf, sizeof(buf)));
+                    }
+                }
+                lag = max<int64_t>(lag, chrono::duration_cast<chrono::microseconds>(Clock::now() - due).count());
+                sent_at.emplace_back(Clock::now());
+                if (send(fd, audio.data() + pos, CHUNK * sizeof(int16_t), MSG_NOSIGNAL) < 0) {
+                    ++failed;
+                    break;
+                }
+                pos = (pos + CHUNK) % audio.size();
+            }
+            shutdown(fd, SHUT_WR);
+            for (ssize_t len; (len = read(fd, buf, sizeof(buf))) > 0;) {
+                receive(buf, len);
+            }
+            close(fd);
+            for (auto cur = max_lag_us.load(); cur < lag && !max_lag_us.compare_exchange_weak(cur, lag););
+            lock_guard lock(stats_mutex);
+            latencies.insert(latencies.end(), stream_latencies.begin(), stream_latencies.end());
+            if (!finished) {
+                ++unfinished;
+                return;
+            }
+            evaluated += stream_evaluated;
+            dropped += stream_dropped;
+            streams_with_drops += stream_dropped > 0;
+            max_queue_delay_ms = max(max_queue_delay_ms, stream_delay_ms);
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    float wall = chrono::duration<float>(Clock::now() - start).count();
+    nlohmann::json report;
+    report["streams"] = streams;
+    report["failed_streams"] = failed.load();
+    report["audio_seconds_per_stream"] = seconds;
+    report["wall_seconds"] = wall;
+    report["max_send_lag_ms"] = max_lag_us.load() / 1000.0;
+    report["events"] = events.load();
+    // Reported by the server at the end of every stream
+    report["unfinished_streams"] = unfinished;
+    report["hops_evaluated"] = evaluated;
+    report["hops_dropped"] = dropped;
+    report["streams_with_drops"] = streams_with_drops;
+    report["max_queue_delay_ms"] = max_queue_delay_ms;
+    auto latency = nlohmann::json::object();
+    if (!latencies.empty()) {
+        sort(latencies.begin(), latencies.end());
+        latency["mean"] = accumulate(latencies.begin(), latencies.end(), 0.0f) / latencies.size();
+        latency["median"] = latencies[latencies.size() / 2];
+        latency["p95"] = latencies[latencies.size() * 95 / 100];
+        latency["max"] = latencies.back();
+    }
+    report["latency_ms"] = latency;
+    cout << report.dump() << "\n";
+}
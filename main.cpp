@@ -1,5 +1,4 @@
 #include <iostream>
-#include <deque>
 #include <fstream>
 #include <numeric>
 #include <unistd.h>
@@ -13,28 +12,77 @@
 #include <condition_variable>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #include <vosk_api.h>
 #include <nlohmann/json.hpp>
 #include <regex>
-#include "fft.hpp"
+#include "features.hpp"
+#include "detector.hpp"
 #include "sound_reader.hpp"
 #include "skills.hpp"
-#include "alina_net.hpp"
+#include "threads.hpp"
+#include "alina_api.h"
 
 using namespace std;
-using namespace fastrnn;
 
 int main(int argc, char **argv) {
-    if (argc < 4) {
+    string policy = "fifo";
+    int priority = 0;
+    bool lock_memory = false;
+    unsigned period_ms = 0;
+    vector<int> detector_cpus, recognizer_cpus;
+    for (int opt; (opt = getopt(argc, argv, "p:P:c:r:md:")) != -1;) {
+        switch (opt) {
+        case 'p':
+            priority = atoi(optarg);
+            break;
+        case 'P':
+            policy = optarg;
+            break;
+        case 'c':
+            detector_cpus = parse_cpu_list(optarg);
+            break;
+        case 'r':
+            recognizer_cpus = parse_cpu_list(optarg);
+            break;
+        case 'm':
+            lock_memory = true;
+            break;
+        case 'd':
+            period_ms = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    // Four periods must fit into the part of the sound buffer not kept as history
+    if (argc < 4 || argc % 2 || period_ms > 500) {
         cerr << "Specify weights file, treshold and vosk model!\n";
+        cerr << "Other keywords can be added as pairs of weights file and treshold\n";
+        cerr << "Options: -p realtime priority and -P policy (fifo or rr) of the capture thread,\n";
+        cerr << "-c capture thread cpus, -r recognizer cpus, -m lock memory of the detector,\n";
+        cerr << "-d wake up once per given number of ms (at most 500), detection is delayed by up to this time\n";
         return 1;
     }
-    load_from_file(argv[1]);
-    float treshold = atof(argv[2]);
+    // The first model wakes the recognizer, other keywords are only reported
+    vector<alina_model *> models;
+    vector<const char *> names;
+    vector<float> tresholds;
+    for (int i = 1; i < argc; i += (i == 1 ? 3 : 2)) {
+        models.emplace_back(alina_model_load(argv[i]));
+        if (!models.back()) {
+            cerr << "Can't load " << argv[i] << "\n";
+            return 1;
+        }
+        names.emplace_back(argv[i]);
+        tresholds.emplace_back(atof(argv[i + 1]));
+    }
 
     const size_t HISTORY_LEN = 24000; // 1.5 sec
     const size_t MAX_SR_CHUNCK = 8000;
-    SoundBuffer<64000, HISTORY_LEN> buffer;
+    SoundBuffer<64000, HISTORY_LEN> buffer(period_ms * 1000);
     mutex buffer_mutex, state_mutex;
     condition_variable have_keyword, have_audio_history;
     size_t sr_offset = HISTORY_LEN;
@@ -65,7 +113,16 @@ int main(int argc, char **argv) {
 
     bool state = 0;
 
-    thread([&]() {
+    Detector detector(models, tresholds);
+    cerr << models.size() << " keywords, " << detector.lower_count() << " lower layer stacks" << endl;
+    // Only what the capture thread needs is allocated by now. The recognizer model is loaded
+    // after this and is not locked, it is large and is only used after a detection.
+    if (lock_memory && mlockall(MCL_CURRENT)) {
+        cerr << "Can't lock memory: " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    thread recognizer_thread([&]() {
         VoskModel *model = vosk_model_new(argv[3]);
         VoskRecognizer *recognizer = vosk_recognizer_new(model, 16000.0);
         vosk_recognizer_set_max_alternatives(recognizer, 5);
@@ -97,69 +154,52 @@ int main(int argc, char **argv) {
                     break;
                 }
             }
+            // Detections during the phrase belong to it
+            lock_guard lock(state_mutex);
             state = 0;
         }
-    }).detach();
-
-    Tensor<float, 128> window;
-    for (size_t i = 0; i < window.size();) {
-        auto [p, n] = buffer.get_samples(window.size() - i);
-        for (size_t j = 0; j < n; ++j) {
-            window[i + j] = (float) p[j] / numeric_limits<int16_t>::max();
-        }
-        i += n;
+    });
+    // Capture and detection run in this thread, the recognizer keeps default scheduling
+    if (!recognizer_cpus.empty()) {
+        pin_thread(recognizer_thread.native_handle(), recognizer_cpus);
+    }
+    recognizer_thread.detach();
+    if (!detector_cpus.empty()) {
+        pin_thread(pthread_self(), detector_cpus);
+    }
+    if (priority) {
+        set_realtime(pthread_self(), policy, priority);
     }
-    Tensor<float, 128> h(0);
-    const size_t POWER_HISTORY_LEN = 250;
-    std::deque<float> powers;
-    float power_sum = 0;
+
+    size_t xruns = 0;
     while (1) {
-        window.view<2, 64>()[0] = window.view<2, 64>()[1];
-        for (size_t i = 64; i < window.size();) {
-            buffer_mutex.lock();
-            auto [p, n] = buffer.get_samples(window.size() - i);
-            sr_offset = min(HISTORY_LEN, sr_offset + n);
-            if (sr_offset >= MAX_SR_CHUNCK) {
-                have_audio_history.notify_one();
-            }
-            buffer_mutex.unlock();
-            for (size_t j = 0; j < n; ++j) {
-                window[i + j] = (float) p[j] / numeric_limits<int16_t>::max();
-            }
-            i += n;
-        }
-        Tensor<complex<float>, 128> to_fft;
-        for (size_t i = 0; i < window.size(); ++i) {
-            to_fft[i] = complex<float>(window[i]);
-        }
-        fft(to_fft);
-        Tensor<float, 40> spect;
-        for (size_t i = 0; i < spect.size(); ++i) {
-            spect[i] = abs((complex<float> &) to_fft[i + 3]);
-        }
-        float s = accumulate(spect.begin(), spect.end(), 0.0);
-        powers.emplace_back(s);
-        power_sum += s;
-        if (powers.size() > POWER_HISTORY_LEN) {
-            power_sum -= powers.front();
-            powers.pop_front();
+        // The recognizer can read the history while the capture waits for the device
+        buffer.wait_samples(WINDOW_SIZE / 2);
+        buffer_mutex.lock();
+        auto [p, n] = period_ms ? buffer.get_pending(WINDOW_SIZE / 2) : buffer.get_samples(WINDOW_SIZE / 2);
+        sr_offset = min(HISTORY_LEN, sr_offset + n);
+        if (sr_offset >= MAX_SR_CHUNCK) {
+            have_audio_history.notify_one();
         }
-        s /= 40;
-        if (s < 1e-5) {
-            s = 1e-5;
-        }
-        for (auto &x : spect) {
-            x /= s;
-        }
-        float res = apply_once(spect, h);
-        lock_guard lock(state_mutex);
-        auto prev_state = state;
-        state = res > treshold;
-        if (state) {
-            cout << "Alina! " << res << endl;
-            have_keyword.notify_one();
-        } else if (prev_state) {
-            h = 0;
+        buffer_mutex.unlock();
+        if (buffer.xruns() != xruns) {
+            xruns = buffer.xruns();
+            cerr << "Overrun, about " << buffer.estimated_lost_samples() << " samples lost in " << xruns << " overruns" << endl;
         }
+        detector.push(p, n, [&](auto &res, auto &detected) {
+            for (size_t k = 1; k < res.size(); ++k) {
+                if (detected[k]) {
+                    cout << "Keyword " << names[k] << "! " << res[k] << endl;
+                }
+            }
+            // Only set here and cleared by the recognizer. A burst of -d can contain the whole detection,
+            // so the flag must not follow the later hops of the burst.
+            if (detected[0]) {
+                cout << "Alina! " << res[0] << endl;
+                lock_guard lock(state_mutex);
+                state = 1;
+                have_keyword.notify_one();
+            }
+        });
     }
 }
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include "fastrnn/tensor.hpp"
+#include "fastrnn/variable.hpp"
+#include "fastrnn/gru.hpp"
+#include "fastrnn/linear.hpp"
+#include "sparse.hpp"
+
+template<size_t... sizes>
+struct Sizes {};
+
+// Storage of weights and the gate convention of fastrnn, needed to multiply the weights directly
+struct WeightsLayout {
+    bool linear_transposed; // Linear::W is [in][out] instead of [out][in]
+    bool w_transposed, u_transposed; // same for Wr, Wz, Wh and Ur, Uz, Uh of GRUCell
+    bool reset_after; // reset gate is applied to Uh h instead of h
+    bool z_keeps_new; // h' = z n + (1 - z) h instead of (1 - z) n + z h
+};
+
+// Layout of Linear and GRUCell of the fastrnn submodule, Model::raw_kernels checks it
+constexpr WeightsLayout FASTRNN_LAYOUT{false, true, true, true, false};
+
+// GRUCell evaluated on raw weights in FASTRNN_LAYOUT. Matrix is MatrixRef for the dense weights
+// of a model and BlockSparseMatrix for pruned ones. Biases are not owned.
+template<class Matrix, size_t in, size_t hidden>
+struct GRUKernel {
+    Matrix Wr, Ur, Wz, Uz, Wh, Uh;
+    const float *br, *bz, *bh;
+
+    // Steps m <= max_batch states, x and h are m vectors stored one after another
+    template<size_t max_batch>
+    void operator()(const float *x, float *h, size_t m) const {
+        float r[max_batch * hidden], z[max_batch * hidden], n[max_batch * hidden], u[max_batch * hidden];
+        for (size_t j = 0; j < m; ++j) {
+            std::copy(br, br + hidden, r + j * hidden);
+            std::copy(bz, bz + hidden, z + j * hidden);
+            std::copy(bh, bh + hidden, n + j * hidden);
+        }
+        Wr.multiply_add(x, r, m);
+        Ur.multiply_add(h, r, m);
+        Wz.multiply_add(x, z, m);
+        Uz.multiply_add(h, z, m);
+        Wh.multiply_add(x, n, m);
+        const size_t size = m * hidden;
+        for (size_t i = 0; i < size; ++i) {
+            r[i] = 1 / (1 + std::exp(-r[i]));
+            z[i] = 1 / (1 + std::exp(-z[i]));
+        }
+        if constexpr (FASTRNN_LAYOUT.reset_after) {
+            std::fill(u, u + size, 0.0f);
+            Uh.multiply_add(h, u, m);
+            for (size_t i = 0; i < size; ++i) {
+                n[i] += r[i] * u[i];
+            }
+        } else {
+            for (size_t i = 0; i < size; ++i) {
+                u[i] = r[i] * h[i];
+            }
+            Uh.multiply_add(u, n, m);
+        }
+        for (size_t i = 0; i < size; ++i) {
+            float k = FASTRNN_LAYOUT.z_keeps_new ? z[i] : 1 - z[i];
+            h[i] = k * std::tanh(n[i]) + (1 - k) * h[i];
+        }
+    }
+};
+
+// Applies model to s frames starting from the zero state. Returns maximal probability.
+template<class Model>
+float apply_sequence(Model &model, const float *arr, size_t s, float *out) {
+    typename Model::Input x;
+    typename Model::State h(0);
+    float ans = 0;
+    for (size_t i = 0; i < s; ++i) {
+        memcpy(x.data(), arr + i * Model::input_size, sizeof(x));
+        float res = model.apply_once(x, h);
+        if (out) {
+            *out++ = res;
+        }
+        ans = std::max(ans, res);
+    }
+    return ans;
+}
+
+// Linear layers with sizes[k] inputs and sizes[k + 1] outputs. Every layer is followed by ReLU,
+// except the last one when relu_last is false.
+template<bool relu_last, size_t... sizes>
+class Stack {
+public:
+    static constexpr std::array<size_t, sizeof...(sizes)> size = {sizes...};
+    static constexpr size_t depth = sizeof...(sizes) - 1;
+    static constexpr size_t in_size = size[0], out_size = size[depth];
+    static constexpr size_t max_size = std::max({sizes...});
+    static_assert(depth > 0);
+
+    template<size_t k>
+    using Layer = fastrnn::Linear<float, size[k], size[k + 1], true>;
+
+    template<class F>
+    void for_each_layer(F &&f) {
+        std::apply([&f](auto &...l) { (f(l), ...); }, layers);
+    }
+
+    template<class F>
+    void for_each_param(F &&f) {
+        for_each_layer([&f](auto &l) {
+            f(l.W); f(l.b);
+        });
+    }
+
+    template<class Gen>
+    void init(Gen &gen) {
+        for_each_layer([&gen](auto &l) {
+            l = std::remove_reference_t<decltype(l)>(gen);
+        });
+    }
+
+    template<class Optimizer>
+    void register_in_optimizer(Optimizer &opt) {
+        for_each_layer([&opt](auto &l) {
+            l.register_in_optimizer(opt);
+        });
+    }
+
+    // Applies the layers to m <= max_batch inputs one layer at a time. With raw every weight matrix
+    // is multiplied by all the inputs at once, otherwise fastrnn evaluates the inputs one by one.
+    template<size_t max_batch, bool raw, size_t k = 0>
+    void batch(const fastrnn::Tensor<float, size[k]> *x, fastrnn::Tensor<float, out_size> *out, size_t m) {
+        auto layer = [this, m](const fastrnn::Tensor<float, size[k]> *x, fastrnn::Tensor<float, size[k + 1]> *y) {
+            auto &l = std::get<k>(layers);
+            if constexpr (raw) {
+                static_assert(sizeof(*x) == size[k] * sizeof(float) && sizeof(*y) == size[k + 1] * sizeof(float));
+                for (size_t i = 0; i < m; ++i) {
+                    y[i] = l.b;
+                }
+                MatrixRef{l.W.data(), size[k + 1], size[k], FASTRNN_LAYOUT.linear_transposed}.multiply_add(x[0].data(), y[0].data(), m);
+            } else {
+                for (size_t i = 0; i < m; ++i) {
+                    l.no_grad()(x[i], y[i]);
+                }
+            }
+            if constexpr (k + 1 < depth || relu_last) {
+                for (size_t i = 0; i < m; ++i) {
+                    relu(y[i], y[i]);
+                }
+            }
+        };
+        if constexpr (k + 1 == depth) {
+            layer(x, out);
+        } else {
+            fastrnn::Tensor<float, size[k + 1]> a[max_batch];
+            layer(x, a);
+            batch<max_batch, raw, k + 1>(a, out, m);
+        }
+    }
+
+    // Adds the layers to the training graph and returns the output variable
+    template<size_t k = 0, class X, class Allocator, class Executer>
+    auto graph(X &x, fastrnn::GradientCalculator &calc, Allocator &alloc, Executer &exe) {
+        using fastrnn::Variable;
+        constexpr size_t n = size[k + 1];
+        Variable o(*alloc.template allocate<n>(), *alloc.template allocate<n>());
+        std::get<k>(layers)(x, o, calc, exe);
+        if constexpr (k + 1 < depth || relu_last) {
+            Variable r(*alloc.template allocate<n>(), *alloc.template allocate<n>());
+            calc.relu(o, r, exe);
+            if constexpr (k + 1 < depth) {
+                return graph<k + 1>(r, calc, alloc, exe);
+            } else {
+                return r;
+            }
+        } else {
+            return o;
+        }
+    }
+
+    static constexpr size_t multiplications() {
+        size_t ans = 0;
+        for (size_t k = 0; k < depth; ++k) {
+            ans += size[k] * size[k + 1];
+        }
+        return ans;
+    }
+
+    // Bytes written for the parameters given by for_each_param
+    static constexpr size_t param_bytes() {
+        return []<size_t... k>(std::index_sequence<k...>) {
+            return ((sizeof(Layer<k>::W) + sizeof(Layer<k>::b)) + ...);
+        }(std::make_index_sequence<depth>());
+    }
+private:
+    template<size_t... k>
+    static auto make_layers(std::index_sequence<k...>) -> std::tuple<Layer<k>...>;
+
+    decltype(make_layers(std::make_index_sequence<depth>())) layers;
+};
+
+// Keyword network: lower stack, GRU and upper stack ending with two logits. Every variant of sizes
+// is a separate type with its own unrolled inference step, training graph and file format.
+// Weights are stored as the lower stack, the upper stack and then the GRU.
+template<class LowerSizes, size_t state, class UpperSizes>
+struct Model;
+
+template<size_t... lower_sizes, size_t state, size_t... upper_sizes>
+struct Model<Sizes<lower_sizes...>, state, Sizes<upper_sizes...>> {
+    using Lower = Stack<true, lower_sizes...>;
+    using Upper = Stack<false, state, upper_sizes...>;
+    using Cell = fastrnn::GRUCell<float, Lower::out_size, state, true>;
+    static_assert(Upper::out_size == 2);
+
+    static constexpr size_t input_size = Lower::in_size, feature_size = Lower::out_size, state_size = state;
+    using Input = fastrnn::Tensor<float, input_size>;
+    using Features = fastrnn::Tensor<float, feature_size>;
+    using State = fastrnn::Tensor<float, state_size>;
+
+    Lower lower;
+    Cell cell;
+    Upper upper;
+
+    // Parameters of the lower stack, which can be shared by several keywords
+    template<class F>
+    void for_each_lower_param(F &&f) {
+        lower.for_each_param(f);
+    }
+
+    template<class F>
+    void for_each_param(F &&f) {
+        for_each_lower_param(f);
+        upper.for_each_param(f);
+
+        f(cell.Wr); f(cell.Ur); f(cell.br);
+        f(cell.Wz); f(cell.Uz); f(cell.bz);
+        f(cell.Wh); f(cell.Uh); f(cell.bh);
+    }
+
+    template<class Gen>
+    void init(Gen &gen) {
+        cell = Cell(gen);
+        lower.init(gen);
+        upper.init(gen);
+    }
+
+    template<class Optimizer>
+    void register_in_optimizer(Optimizer &opt, bool with_lower) {
+        cell.register_in_optimizer(opt);
+        if (with_lower) {
+            lower.register_in_optimizer(opt);
+        }
+        upper.register_in_optimizer(opt);
+    }
+
+    static constexpr size_t max_batch = 16;
+
+    bool same_lower(Model &other) {
+        std::vector<std::pair<const char *, size_t>> params;
+        for_each_lower_param([&params](auto &t) {
+            params.emplace_back(reinterpret_cast<const char *>(t.data()), sizeof(t));
+        });
+        auto it = params.begin();
+        bool same = true;
+        other.for_each_lower_param([&it, &same](auto &t) {
+            same = same && !memcmp(it->first, t.data(), it->second);
+            ++it;
+        });
+        return same;
+    }
+
+    // The batched kernels multiply the weights directly and rely on FASTRNN_LAYOUT. It is checked once
+    // on random weights. If fastrnn disagrees, the layers are evaluated one sample at a time by fastrnn.
+    static bool raw_kernels() {
+        static const bool same = [] {
+            auto m = std::make_unique<Model>();
+            std::mt19937 gen(1);
+            std::uniform_real_distribution<float> dist(-0.2, 0.2);
+            auto rnd = [&] {
+                return dist(gen);
+            };
+            m->init(rnd);
+            Input x[2];
+            State h[2][2];
+            for (size_t i = 0; i < 2; ++i) {
+                std::generate(x[i].data(), x[i].data() + input_size, rnd);
+                std::generate(h[0][i].data(), h[0][i].data() + state_size, rnd);
+                h[1][i] = h[0][i];
+            }
+            State *ph[2][2] = {{&h[0][0], &h[0][1]}, {&h[1][0], &h[1][1]}};
+            float out[2][2];
+            m->template step<false>(x, ph[0], out[0], 2);
+            m->template step<true>(x, ph[1], out[1], 2);
+            bool same = true;
+            for (size_t i = 0; i < 2; ++i) {
+                same = same && std::abs(out[0][i] - out[1][i]) < 1e-4;
+                for (size_t j = 0; j < state_size; ++j) {
+                    same = same && std::abs(h[0][i][j] - h[1][i][j]) < 1e-4;
+                }
+            }
+            if (!same) {
+                std::cerr << "Weights layout of fastrnn differs from FASTRNN_LAYOUT, batched kernels are disabled\n";
+            }
+            return same;
+        }();
+        return same;
+    }
+
+    // Lower stack for m <= max_batch frames
+    void lower_batch(const Input *x, Features *out, size_t m) {
+        if (raw_kernels()) {
+            lower.template batch<max_batch, true>(x, out, m);
+        } else {
+            lower.template batch<max_batch, false>(x, out, m);
+        }
+    }
+
+    // GRU and upper stack for m <= max_batch sequences
+    void upper_batch(const Features *x, State *const *h, float *out, size_t m) {
+        if (raw_kernels()) {
+            upper_step<true>(x, h, out, m);
+        } else {
+            upper_step<false>(x, h, out, m);
+        }
+    }
+
+    // Evaluates one step for n independent sequences layer by layer. With the raw kernels
+    // every weight matrix is read once per up to max_batch sequences.
+    void apply_batch(const Input *x, State *const *h, float *out, size_t n) {
+        Features a[max_batch];
+        for (size_t from = 0; from < n; from += max_batch) {
+            size_t m = std::min(max_batch, n - from);
+            lower_batch(x + from, a, m);
+            upper_batch(a, h + from, out + from, m);
+        }
+    }
+
+    float apply_once(const Input &x, State &h) {
+        auto p = &h;
+        float ans;
+        apply_batch(&x, &p, &ans, 1);
+        return ans;
+    }
+
+    float apply_to(const float *arr, size_t s, float *out) {
+        return apply_sequence(*this, arr, s, out);
+    }
+
+    bool save(const char *name) {
+        std::ofstream out(name, std::ios::out | std::ios::binary);
+        for_each_param([&out](auto &t) {
+            out.write(reinterpret_cast<char *>(t.data()), sizeof(t));
+        });
+        return bool(out);
+    }
+
+    // Fails without changing the weights if the file has another size, so a file of another
+    // architecture is never read as this one
+    bool load(const char *name) {
+        std::error_code err;
+        if (std::filesystem::file_size(name, err) != file_size() || err) {
+            return false;
+        }
+        std::ifstream in(name, std::ios::in | std::ios::binary);
+        for_each_param([&in](auto &t) {
+            in.read(reinterpret_cast<char *>(t.data()), sizeof(t));
+        });
+        return bool(in);
+    }
+
+    static constexpr size_t multiplications() {
+        return Lower::multiplications() + 3 * (feature_size + state_size) * state_size + Upper::multiplications();
+    }
+
+    // Size of the file written by save. Files don't store the sizes, so they are told apart by it.
+    static constexpr size_t file_size() {
+        return Lower::param_bytes() + Upper::param_bytes() +
+            sizeof(Cell::Wr) + sizeof(Cell::Ur) + sizeof(Cell::br) +
+            sizeof(Cell::Wz) + sizeof(Cell::Uz) + sizeof(Cell::bz) +
+            sizeof(Cell::Wh) + sizeof(Cell::Uh) + sizeof(Cell::bh);
+    }
+private:
+    using CellKernel = GRUKernel<MatrixRef, feature_size, state_size>;
+
+    CellKernel cell_kernel() {
+        auto w = [](auto &t) {
+            return MatrixRef{t.data(), state_size, feature_size, FASTRNN_LAYOUT.w_transposed};
+        };
+        auto u = [](auto &t) {
+            return MatrixRef{t.data(), state_size, state_size, FASTRNN_LAYOUT.u_transposed};
+        };
+        return {w(cell.Wr), u(cell.Ur), w(cell.Wz), u(cell.Uz), w(cell.Wh), u(cell.Uh), cell.br.data(), cell.bz.data(), cell.bh.data()};
+    }
+
+    template<bool raw>
+    void upper_step(const Features *x, State *const *h, float *out, size_t m) {
+        State a[max_batch];
+        fastrnn::Tensor<float, 2> o[max_batch];
+        for (size_t i = 0; i < m; ++i) {
+            a[i] = *h[i];
+        }
+        if constexpr (raw) {
+            static_assert(sizeof(Features) == feature_size * sizeof(float) && sizeof(State) == state_size * sizeof(float));
+            cell_kernel().template operator()<max_batch>(x[0].data(), a[0].data(), m);
+        } else {
+            State nh;
+            for (size_t i = 0; i < m; ++i) {
+                cell.no_grad()(x[i], a[i], nh);
+                a[i] = nh;
+            }
+        }
+        for (size_t i = 0; i < m; ++i) {
+            *h[i] = a[i];
+        }
+        upper.template batch<max_batch, raw>(a, o, m);
+        for (size_t i = 0; i < m; ++i) {
+            o[i] -= *std::max_element(o[i].begin(), o[i].end());
+            exp(o[i], o[i]);
+            out[i] = o[i][1] / (o[i][0] + o[i][1]);
+        }
+    }
+
+    template<bool raw>
+    void step(const Input *x, State *const *h, float *out, size_t m) {
+        Features a[max_batch];
+        lower.template batch<max_batch, raw>(x, a, m);
+        upper_step<raw>(a, h, out, m);
+    }
+};
@@ -0,0 +1,315 @@
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "features.hpp"
+#include "threads.hpp"
+#include "alina_api.h"
+
+using namespace std;
+using namespace fastrnn;
+using Clock = chrono::steady_clock;
+
+// One client connection. Clients send 16 kHz mono s16le PCM and receive a line
+// "<hop> <probability>" for every hop where the keyword is detected. Hops are numbered
+// from 1 in the order they arrive, so dropped hops don't shift the numbers. After the client
+// shuts down its side and the rest is evaluated, the stream ends with a line
+// "end <evaluated hops> <dropped hops> <max queue delay ms>".
+struct Stream {
+    struct Hop {
+        FeatureExtractor::Frame frame;
+        Clock::time_point time;
+        size_t index;
+    };
+
+    Stream(int fd, const alina_model *model): fd(fd), state(alina_stream_create(model, 1)) {}
+    ~Stream() {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "end %zu %zu %f\n", hops, dropped, chrono::duration<float, milli>(max_wait).count());
+        send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        alina_stream_free(state);
+        close(fd);
+    }
+
+    int fd;
+    alina_stream *state;
+
+    // Used by the I/O thread only
+    FeatureExtractor features;
+    char carry;
+    bool has_carry = false;
+    size_t received = 0;
+
+    // Guarded by the scheduler mutex
+    deque<Hop> pending;
+    bool in_flight = false;
+    size_t dropped = 0;
+    Clock::duration max_wait{};
+
+    // Used by the worker evaluating the stream
+    size_t hop = 0, hops = 0;
+    bool detected = false;
+};
+
+// Collects hops of all streams into batches. A batch is dispatched when it is full or
+// when the oldest hop waits for max_delay. A stream is in at most one batch at a time,
+// because its hops depend on each other through the GRU state.
+class Scheduler {
+public:
+    Scheduler(size_t max_batch, Clock::duration max_delay, size_t max_pending):
+        max_batch(max_batch), max_delay(max_delay), max_pending(max_pending) {}
+
+    void push(const shared_ptr<Stream> &stream, vector<FeatureExtractor::Frame> &frames, Clock::time_point time) {
+        if (frames.empty()) {
+            return;
+        }
+        lock_guard lock(queue_mutex);
+        bool was_empty = stream->pending.empty();
+        for (auto &x : frames) {
+            stream->pending.push_back({x, time, ++stream->received});
+        }
+        while (stream->pending.size() > max_pending) {
+            stream->pending.pop_front();
+            ++dropped;
+            ++stream->dropped;
+        }
+        if (was_empty && !stream->in_flight) {
+            ready.emplace_back(stream);
+            have_work.notify_one();
+        }
+    }
+
+    // Blocks until a batch is ready
+    void take(vector<shared_ptr<Stream>> &batch, vector<float> &frames) {
+        unique_lock lock(queue_mutex);
+        while (1) {
+            if (ready.size() >= max_batch) {
+                break;
+            }
+            if (ready.empty()) {
+                have_work.wait(lock);
+                continue;
+            }
+            auto deadline = oldest() + max_delay;
+            if (Clock::now() >= deadline) {
+                break;
+            }
+            have_work.wait_until(lock, deadline);
+        }
+        size_t n = min(max_batch, ready.size());
+        nth_element(ready.begin(), ready.begin() + (n - 1), ready.end(), [](auto &a, auto &b) {
+            return a->pending.front().time < b->pending.front().time;
+        });
+        batch.assign(ready.begin(), ready.begin() + n);
+        ready.erase(ready.begin(), ready.begin() + n);
+        frames.resize(n * ALINA_CODE_SIZE);
+        auto now = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            auto &stream = batch[i];
+            auto &[frame, time, index] = stream->pending.front();
+            copy(frame.data(), frame.data() + ALINA_CODE_SIZE, frames.data() + i * ALINA_CODE_SIZE);
+            max_wait = max(max_wait, now - time);
+            stream->max_wait = max(stream->max_wait, now - time);
+            stream->hop = index;
+            stream->pending.pop_front();
+            stream->in_flight = true;
+        }
+        ++batches;
+        hops += n;
+        if (!ready.empty()) {
+            have_work.notify_one();
+        }
+    }
+
+    void done(const vector<shared_ptr<Stream>> &batch) {
+        lock_guard lock(queue_mutex);
+        for (auto &stream : batch) {
+            stream->in_flight = false;
+            if (!stream->pending.empty()) {
+                ready.emplace_back(stream);
+            }
+        }
+        have_work.notify_all();
+    }
+
+    void report(ostream &out) {
+        lock_guard lock(queue_mutex);
+        out << batches << " batches, " << (batches ? (float) hops / batches : 0) << " hops per batch, "
+            << chrono::duration<float, milli>(max_wait).count() << " ms max wait, "
+            << dropped << " hops dropped" << endl;
+        batches = hops = dropped = 0;
+        max_wait = {};
+    }
+private:
+    Clock::time_point oldest() const {
+        auto ans = Clock::time_point::max();
+        for (auto &stream : ready) {
+            ans = min(ans, stream->pending.front().time);
+        }
+        return ans;
+    }
+
+    size_t max_batch;
+    Clock::duration max_delay;
+    size_t max_pending;
+    mutex queue_mutex;
+    condition_variable have_work;
+    vector<shared_ptr<Stream>> ready;
+    size_t batches = 0, hops = 0, dropped = 0;
+    Clock::duration max_wait{};
+};
+
+int main(int argc, char **argv) {
+    string socket_path = "/tmp/alina.sock";
+    size_t workers = thread::hardware_concurrency(), max_batch = 32;
+    float max_delay_ms = 20;
+    vector<int> cpus;
+    for (int opt; (opt = getopt(argc, argv, "s:w:b:l:c:")) != -1;) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'w':
+            workers = strtoul(optarg, nullptr, 10);
+            break;
+        case 'b':
+            max_batch = strtoul(optarg, nullptr, 10);
+            break;
+        case 'l':
+            max_delay_ms = atof(optarg);
+            break;
+        case 'c':
+            cpus = parse_cpu_list(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || workers == 0 || max_batch == 0) {
+        cerr << "Usage: " << argv[0] << " [-s socket] [-w workers] [-b max batch] [-l max delay ms] [-c worker cpus] weights treshold\n";
+        return 1;
+    }
+    auto model = alina_model_load(argv[optind]);
+    if (!model) {
+        cerr << "Can't load " << argv[optind] << "\n";
+        return 1;
+    }
+    float treshold = atof(argv[optind + 1]);
+
+    const size_t MAX_PENDING = 2 * SAMPLE_RATE / (WINDOW_SIZE / 2); // 2 sec
+    Scheduler scheduler(max_batch, chrono::duration_cast<Clock::duration>(chrono::duration<float, milli>(max_delay_ms)), MAX_PENDING);
+
+    vector<thread> pool;
+    for (size_t w = 0; w < workers; ++w) {
+        pool.emplace_back([&] {
+            vector<shared_ptr<Stream>> batch;
+            vector<alina_stream *> states;
+            vector<float> frames;
+            while (1) {
+                scheduler.take(batch, frames);
+                states.resize(batch.size());
+                transform(batch.begin(), batch.end(), states.begin(), [](auto &s) { return s->state; });
+                alina_stream_push_batch(states.data(), frames.data(), batch.size());
+                for (auto &stream : batch) {
+                    float res;
+                    alina_stream_read(stream->state, &res, 1);
+                    ++stream->hops;
+                    auto prev_detected = stream->detected;
+                    stream->detected = res > treshold;
+                    if (stream->detected) {
+                        char buf[64];
+                        int len = snprintf(buf, sizeof(buf), "%zu %f\n", stream->hop, res);
+                        send(stream->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+                    } else if (prev_detected) {
+                        alina_stream_reset(stream->state);
+                    }
+                }
+                scheduler.done(batch);
+                // Closed connections are released with the last reference
+                batch.clear();
+            }
+        });
+        if (!cpus.empty()) {
+            pin_thread(pool.back().native_handle(), {cpus[w % cpus.size()]});
+        }
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(listen_fd, SOMAXCONN)) {
+        cerr << "Can't listen on " << socket_path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    int epoll_fd = epoll_create1(0);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    cerr << "Listening on " << socket_path << endl;
+
+    unordered_map<int, shared_ptr<Stream>> streams;
+    vector<FeatureExtractor::Frame> frames;
+    const auto REPORT_PERIOD = chrono::seconds(10);
+    auto next_report = Clock::now() + REPORT_PERIOD;
+    epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, size(events), 1000);
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                for (int client; (client = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0;) {
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev);
+                    streams.emplace(client, make_shared<Stream>(client, model));
+                }
+                continue;
+            }
+            auto &stream = streams[fd];
+            char buf[1 << 14];
+            ssize_t len;
+            while ((len = read(fd, buf + 1, sizeof(buf) - 1)) > 0) {
+                char *p = buf + 1;
+                if (stream->has_carry) {
+                    *--p = stream->carry;
+                    ++len;
+                }
+                stream->has_carry = len % 2;
+                if (stream->has_carry) {
+                    stream->carry = p[--len];
+                }
+                frames.clear();
+                int16_t samples[sizeof(buf) / 2];
+                memcpy(samples, p, len);
+                stream->features.push(samples, len / 2, [&frames](auto &x) { frames.emplace_back(x); });
+                scheduler.push(stream, frames, Clock::now());
+            }
+            if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // Pending hops are still evaluated, the connection is closed with the last reference
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                streams.erase(fd);
+            }
+        }
+        if (Clock::now() >= next_report) {
+            cerr << streams.size() << " streams, ";
+            scheduler.report(cerr);
+            next_report += REPORT_PERIOD;
+        }
+    }
+}
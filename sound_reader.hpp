@@ -5,6 +5,9 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
 #include <alsa/asoundlib.h>
 
 template<size_t size, size_t history, unsigned required_rate = 16000>
@@ -14,6 +17,25 @@ private:
     size_t start{0}, end{0};
     unsigned step, channels;
     int16_t buffer[size];
+    size_t xrun_count = 0, lost_estimate = 0;
+    std::chrono::steady_clock::time_point last_read;
+
+    // Restarts capture after an overrun or suspend. Samples captured since the last read are lost.
+    void recover(int err) {
+        auto now = std::chrono::steady_clock::now();
+        ++xrun_count;
+        lost_estimate += std::chrono::duration<double>(now - last_read).count() * required_rate;
+        if (int e = snd_pcm_recover(handle, err, 1); e < 0) {
+            throw std::runtime_error(std::string("Recover error: ") + snd_strerror(e));
+        }
+        // A device resumed after a suspend may be running already
+        if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+            if (int e = snd_pcm_start(handle); e < 0) {
+                throw std::runtime_error(std::string("Start error: ") + snd_strerror(e));
+            }
+        }
+        last_read = now;
+    }
 
     void read_some() {
         snd_pcm_uframes_t offset = 0, frames = (size - history - max_samples()) * step / channels;
@@ -21,11 +43,19 @@ private:
             throw std::runtime_error("Too large buffer is required");
         }
         const snd_pcm_channel_area_t *area;
-        snd_pcm_wait(handle, -1);
+        if (int err = snd_pcm_wait(handle, -1); err < 0) {
+            recover(err);
+            return;
+        }
         if (int err = snd_pcm_avail_update(handle); err < 0) {
-            throw std::runtime_error(std::string("Update error: ") + snd_strerror(err));
+            recover(err);
+            return;
         }
         if (int err = snd_pcm_mmap_begin(handle, &area, &offset, &frames)) {
+            if (err == -EPIPE || err == -ESTRPIPE) {
+                recover(err);
+                return;
+            }
             throw std::runtime_error(std::string("MMAP error: ") + snd_strerror(err));
         }
         assert(area->first % 16 == 0);
@@ -34,13 +64,17 @@ private:
             buffer[end] = (reinterpret_cast<int16_t *>(area->addr) + area->first / 16 + offset * channels)[i * step];
             end = (end + 1) % size;
         }
-        if (int err = snd_pcm_mmap_commit(handle, offset, frames); err < 0) {
-            throw std::runtime_error(std::string("Commit error: ") + snd_strerror(err));
+        if (auto err = snd_pcm_mmap_commit(handle, offset, frames); err < 0 || (snd_pcm_uframes_t) err != frames) {
+            recover(err < 0 ? err : -EPIPE);
+            return;
         }
+        last_read = std::chrono::steady_clock::now();
     }
 
 public:
-    SoundBuffer() {
+    // With nonzero period_us the device wakes the reader once per period instead of the
+    // default 50 ms, so samples arrive in bursts of period_us
+    explicit SoundBuffer(unsigned period_us = 0) {
         if (int err = snd_pcm_open(&handle, "hw:1,0", SND_PCM_STREAM_CAPTURE, 0)) {
             throw std::runtime_error(std::string("Open error: ") + snd_strerror(err));
         }
@@ -77,23 +111,51 @@ public:
             channels,
             rate,
             0,
-            200'000)) {
+            // The buffer holds 4 periods
+            period_us ? std::max(4 * period_us, 200'000u) : 200'000)) {
             throw std::runtime_error(std::string("Setup error: ") + snd_strerror(err));
         }
+        if (period_us) {
+            snd_pcm_sw_params_t *sw_params;
+            snd_pcm_sw_params_malloc(&sw_params);
+            snd_pcm_sw_params_current(handle, sw_params);
+            snd_pcm_sw_params_set_avail_min(handle, sw_params, (uint64_t) rate * period_us / 1'000'000);
+            int err = snd_pcm_sw_params(handle, sw_params);
+            snd_pcm_sw_params_free(sw_params);
+            if (err) {
+                throw std::runtime_error(std::string("Software params error: ") + snd_strerror(err));
+            }
+        }
         if (int err = snd_pcm_start(handle)) {
             throw std::runtime_error(std::string("Start error: ") + snd_strerror(err));
         }
+        last_read = std::chrono::steady_clock::now();
     }
     ~SoundBuffer() {
         snd_pcm_close(handle);
     }
+    // Number of overruns recovered from
+    size_t xruns() const {
+        return xrun_count;
+    }
+    // Samples lost in overruns, estimated from the time between the last read and the recovery.
+    // ALSA doesn't report how many frames an overrun dropped.
+    size_t estimated_lost_samples() const {
+        return lost_estimate;
+    }
     size_t max_samples() {
         return (end - start + size) % size;
     }
-    std::pair<const int16_t*, size_t> get_samples(size_t n) {
+    // Reads from the device until n samples are available. Reading changes only end and the
+    // free part of the buffer, which get_history doesn't touch, so the reader thread can wait here
+    // without holding the lock which guards get_history.
+    void wait_samples(size_t n) {
         while (max_samples() < n) {
             read_some();
         }
+    }
+    std::pair<const int16_t*, size_t> get_samples(size_t n) {
+        wait_samples(n);
         if (size - start > n) {
             start += n;
             return {buffer + start - n, n};
@@ -103,6 +165,14 @@ public:
             return ret;
         }
     }
+    // Waits for at least n samples and returns all samples read so far. Less than n samples
+    // are returned at the end of the buffer, like in get_samples.
+    std::pair<const int16_t*, size_t> get_pending(size_t n) {
+        wait_samples(n);
+        size_t from = start, len = std::min(max_samples(), size - start);
+        start = (start + len) % size;
+        return {buffer + from, len};
+    }
     std::pair<const int16_t*, size_t> get_history(size_t n) const {
         size_t h_start = (start - n + size) % size;
         return {buffer + h_start, h_start < start ? n : size - h_start};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <cinttypes>
+#include <stdexcept>
+#include <algorithm>
+
+// Dense matrix stored either as [out][in] or as [in][out]
+struct MatrixRef {
+    float *data;
+    size_t out, in;
+    bool transposed;
+
+    float &operator()(size_t o, size_t i) const {
+        return transposed ? data[i * out + o] : data[o * in + i];
+    }
+
+    // y[j] += W x[j] for m vectors stored one after another. Every weight is loaded once
+    // for all the vectors, a row or a column of W stays in L1 while it is used.
+    void multiply_add(const float *x, float *y, size_t m) const {
+        if (transposed) {
+            for (size_t i = 0; i < in; ++i) {
+                const float *w = data + i * out;
+                for (size_t j = 0; j < m; ++j) {
+                    float xi = x[j * in + i];
+                    float *yj = y + j * out;
+                    for (size_t o = 0; o < out; ++o) {
+                        yj[o] += w[o] * xi;
+                    }
+                }
+            }
+        } else {
+            for (size_t o = 0; o < out; ++o) {
+                const float *w = data + o * in;
+                for (size_t j = 0; j < m; ++j) {
+                    const float *xj = x + j * in;
+                    float s = 0;
+                    for (size_t i = 0; i < in; ++i) {
+                        s += w[i] * xj[i];
+                    }
+                    y[j * out + o] += s;
+                }
+            }
+        }
+    }
+};
+
+// Matrix of BLOCK x BLOCK blocks where only nonzero blocks are stored, block rows are in CSR format
+class BlockSparseMatrix {
+public:
+    static constexpr size_t BLOCK = 4;
+
+    BlockSparseMatrix() = default;
+
+    explicit BlockSparseMatrix(const MatrixRef &m): out(m.out), in(m.in) {
+        if (in % BLOCK) {
+            throw std::invalid_argument("Number of columns must be a multiple of block size");
+        }
+        row_start.emplace_back(0);
+        for (size_t r = 0; r < out; r += BLOCK) {
+            for (size_t c = 0; c < in; c += BLOCK) {
+                float block[BLOCK * BLOCK] = {};
+                bool zero = true;
+                for (size_t i = 0; i < BLOCK && r + i < out; ++i) {
+                    for (size_t j = 0; j < BLOCK; ++j) {
+                        block[i * BLOCK + j] = m(r + i, c + j);
+                        zero = zero && block[i * BLOCK + j] == 0;
+                    }
+                }
+                if (!zero) {
+                    col.emplace_back(c / BLOCK);
+                    values.insert(values.end(), block, block + BLOCK * BLOCK);
+                }
+            }
+            row_start.emplace_back(col.size());
+        }
+    }
+
+    // y[j] += W x[j] for m vectors stored one after another, every block is loaded once for all of them
+    void multiply_add(const float *x, float *y, size_t m = 1) const {
+        for (size_t rb = 0; rb + 1 < row_start.size(); ++rb) {
+            const size_t rows = std::min(BLOCK, out - rb * BLOCK);
+            for (size_t k = row_start[rb]; k < row_start[rb + 1]; ++k) {
+                const float *v = values.data() + k * BLOCK * BLOCK;
+                for (size_t t = 0; t < m; ++t) {
+                    const float *xs = x + t * in + col[k] * BLOCK;
+                    float *ys = y + t * out + rb * BLOCK;
+                    for (size_t i = 0; i < rows; ++i) {
+                        float s = 0;
+                        for (size_t j = 0; j < BLOCK; ++j) {
+                            s += v[i * BLOCK + j] * xs[j];
+                        }
+                        ys[i] += s;
+                    }
+                }
+            }
+        }
+    }
+
+    // Number of multiplications in multiply_add
+    size_t cost() const {
+        return col.size() * BLOCK * BLOCK;
+    }
+private:
+    size_t out = 0, in = 0;
+    std::vector<uint32_t> row_start, col;
+    std::vector<float> values;
+};
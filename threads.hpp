@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+
+// Parses CPU lists like "0,2-3"
+inline std::vector<int> parse_cpu_list(const std::string &s) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        auto item = s.substr(pos, end - pos);
+        auto dash = item.find('-');
+        int from = std::stoi(item.substr(0, dash));
+        int to = dash == std::string::npos ? from : std::stoi(item.substr(dash + 1));
+        for (int i = from; i <= to; ++i) {
+            cpus.emplace_back(i);
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+inline void pin_thread(pthread_t thread, const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (int err = pthread_setaffinity_np(thread, sizeof(set), &set)) {
+        throw std::runtime_error(std::string("Affinity error: ") + strerror(err));
+    }
+}
+
+// CPUs the calling thread is allowed to run on
+inline std::vector<int> thread_cpus() {
+    cpu_set_t set;
+    if (int err = pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) {
+        throw std::runtime_error(std::string("Affinity error: ") + strerror(err));
+    }
+    std::vector<int> cpus;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set)) {
+            cpus.emplace_back(i);
+        }
+    }
+    return cpus;
+}
+
+// policy is "fifo" or "rr"
+inline void set_realtime(pthread_t thread, const std::string &policy, int priority) {
+    if (policy != "fifo" && policy != "rr") {
+        throw std::runtime_error("Unknown scheduling policy " + policy);
+    }
+    sched_param param{};
+    param.sched_priority = priority;
+    if (int err = pthread_setschedparam(thread, policy == "fifo" ? SCHED_FIFO : SCHED_RR, &param)) {
+        throw std::runtime_error(std::string("Scheduling error: ") + strerror(err));
+    }
+}
@@ -1,87 +1,145 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <complex>
 #include <algorithm>
 #include <vector>
 #include <random>
 #include <type_traits>
+#include <deque>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <numeric>
 #include <unistd.h>
 #include <nlohmann/json.hpp>
 #include <AudioFile.h>
 #include <linux/limits.h>
-#include "fft.hpp"
+#include "features.hpp"
+#include "augmentation.hpp"
+#include "bounded_queue.hpp"
+#include "threads.hpp"
 #include "fastrnn/tensor.hpp"
 #include "alina_net.hpp"
 
 using namespace std;
 using namespace fastrnn;
 
-const unsigned SAMPLE_RATE = 16000;
-const unsigned WINDOW_SIZE = 128;
 const unsigned TRAIN_SERIES_LEN = 20;
-const unsigned FREQ_FROM = 3, FREQ_TO = 43;
 
-template<unsigned freq_from, unsigned freq_to, class BidirIt, class OutIt>
-void spectrogram(BidirIt first, BidirIt last, OutIt out) {
-    static_assert(remove_reference<decltype(*out)>::type::static_size == freq_to - freq_from);
-    while (last - first > WINDOW_SIZE) {
-        Tensor<complex<float>, WINDOW_SIZE> window;
-        copy(first, first + WINDOW_SIZE, window.begin());
-        fft(window);
-        transform(window.begin() + freq_from, window.begin() + freq_to, out->begin(), [](auto &x) { return abs(*x.data()); });
-        ++out;
-        first += WINDOW_SIZE / 2;
-    }
-}
+struct TrainConfig {
+    explicit TrainConfig(const nlohmann::json &config, const string &model):
+        seed(config.value("seed", 777u)),
+        lr(config.value("lr", 1e-3f)),
+        positive_weight(config.value("positive_weight", 100.0f)),
+        seq(config.value("seq", (size_t) TRAIN_SERIES_LEN)),
+        model(config.value("model", model)) {}
 
-float get_treshold(vector<float> powers) {
-    auto low = powers.begin() + powers.size() / 10;
-    auto high = powers.begin() + powers.size() / 10 * 9;
-    nth_element(powers.begin(), low, powers.end());
-    nth_element(powers.begin(), high, powers.end());
-    return *low + (*high - *low) * 0.2;
-}
+    uint32_t seed;
+    float lr, positive_weight;
+    size_t seq;
+    string model;
+};
 
-void split(const vector<float> &samples, vector<vector<Tensor<float, FREQ_TO - FREQ_FROM>>> &ans) {
-    vector<Tensor<float, FREQ_TO>> spect(samples.size() / (WINDOW_SIZE / 2) - 1);
-    spectrogram<0, FREQ_TO>(samples.begin(), samples.end(), spect.begin());
-    vector<float> powers(spect.size());
-    transform(spect.begin(), spect.end(), powers.begin(), [](const auto &tensor) {
-        return accumulate(tensor.begin(), tensor.end(), 0.0f);
-    });
-    auto tres = get_treshold(powers);
-    int cur_sum = 0;
-    for (size_t i = 0; i < 100; ++i) {
-        cur_sum += (powers[i] > tres);
-    }
-    for (size_t i = 100; i < 110; ++i) {
-        cur_sum -= 100 * (powers[i] > tres);
-    }
-    size_t last = 0;
-    for (size_t i = 110; i < powers.size(); ++i) {
-        cur_sum -= 100 * (powers[i] > tres);
-        cur_sum += 101 * (powers[i - 10] > tres);
-        cur_sum -= (powers[i - 110] > tres);
-        if (cur_sum > 45 && i - last >= 70) {
-            ans.emplace_back(i - last + 30);
-            transform(spect.begin() + last, spect.begin() + i, ans.back().begin(), [](auto &x) {
-                return x.template subtensor<FREQ_FROM, FREQ_TO>();
-            });
-            last = i;
-        }
+void split(const vector<float> &samples, size_t file, vector<vector<Tensor<float, FREQ_TO - FREQ_FROM>>> &ans, vector<Clip> &clips) {
+    auto spect = full_spectrogram(samples);
+    for (auto [begin, end] : split_utterances(spect)) {
+        ans.emplace_back(end - begin + 30);
+        clips.push_back({file, begin * (WINDOW_SIZE / 2), end * (WINDOW_SIZE / 2) + WINDOW_SIZE, 30});
+        transform(spect.begin() + begin, spect.begin() + end, ans.back().begin(), [](auto &x) {
+            return x.template subtensor<FREQ_FROM, FREQ_TO>();
+        });
     }
 }
 
 int main(int argc, char **argv) {
+    const char *frozen_lower = nullptr;
+    float prune_neurons = 0, prune_blocks = 0;
+    int prune_epochs = -1;
+    const char *sweep = nullptr;
+    string model = architectures()[0];
+    vector<int> cpus;
+    for (int opt; (opt = getopt(argc, argv, "f:n:b:t:s:c:m:")) != -1;) {
+        switch (opt) {
+        case 'f':
+            frozen_lower = optarg;
+            break;
+        case 'n':
+            prune_neurons = atof(optarg);
+            break;
+        case 'b':
+            prune_blocks = atof(optarg);
+            break;
+        case 't':
+            prune_epochs = atoi(optarg);
+            break;
+        case 's':
+            sweep = optarg;
+            break;
+        case 'c':
+            cpus = parse_cpu_list(optarg);
+            break;
+        case 'm':
+            model = optarg;
+            break;
+        default:
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc < 4) {
-        cerr << "Specify dataset directory, output weights files pattern and epochs count\n";
+        cerr << "Specify dataset directory, output weights files pattern, epochs count and optionally augmentation config\n";
+        cerr << "Use -f weights to take lower layers from another keyword model\n";
+        cerr << "Use -n and -b to prune fractions of neurons and 4x4 weight blocks during the last -t epochs\n";
+        cerr << "Use -m to choose the architecture:";
+        for (auto name : architectures()) {
+            cerr << " " << name;
+        }
+        cerr << "\n";
+        cerr << "Use -s sweep.json to train an array of configurations with seed, lr, positive_weight, seq and model\n";
+        cerr << "concurrently on -c cpus, weights files get the configuration index as a suffix\n";
         return 1;
     }
+    const auto process_cpus = thread_cpus();
     int epochs = strtol(argv[3], nullptr, 10);
+    if (prune_epochs < 0) {
+        prune_epochs = max(1, epochs / 2);
+    }
+    prune_epochs = min(prune_epochs, epochs);
+    if (!(prune_neurons >= 0 && prune_neurons <= 1 && prune_blocks >= 0 && prune_blocks <= 1)) {
+        cerr << "Pruned fractions must be from 0 to 1\n";
+        return 1;
+    }
+    if ((prune_neurons || prune_blocks) && prune_epochs <= 0) {
+        cerr << "Pruning needs at least one epoch\n";
+        return 1;
+    }
+    vector<TrainConfig> configs;
+    if (sweep) {
+        for (auto &config : nlohmann::json::parse(ifstream(sweep))) {
+            configs.emplace_back(config, model);
+        }
+        if (configs.empty()) {
+            cerr << "No configurations in " << sweep << "\n";
+            return 1;
+        }
+    } else {
+        configs.emplace_back(nlohmann::json::object(), model);
+    }
     auto meta = nlohmann::json::parse(ifstream(string(argv[1]) + "meta.json"));
+    nlohmann::json augmentation;
+    if (argc > 4) {
+        augmentation = nlohmann::json::parse(ifstream(argv[4]));
+    }
+    const bool augment = !augmentation.is_null();
+    AugmentationConfig augmentation_config(augment ? augmentation : nlohmann::json::object());
+    vector<vector<float>> recordings;
     vector<vector<Tensor<float, FREQ_TO - FREQ_FROM>>> positive, negative;
+    vector<Clip> positive_clips, negative_clips;
     for (auto &x : meta.items()) {
         auto &vec = (x.key().substr(0, 3) == "pos" ? positive : negative);
+        auto &clips = (x.key().substr(0, 3) == "pos" ? positive_clips : negative_clips);
         for (auto &file_meta : x.value()) {
             AudioFile<float> file;
             file.load(string(argv[1]) + "/" + file_meta["path"].get<string>());
@@ -90,75 +148,94 @@ int main(int argc, char **argv) {
                 for (auto reg : file_meta["regions"]) {
                     vec.emplace_back((reg[1].get<int>() - reg[0].get<int>()) / (WINDOW_SIZE / 2) - 1);
                     spectrogram<FREQ_FROM, FREQ_TO>(file.samples[0].begin() + reg[0], file.samples[0].begin() + reg[1], vec.back().begin());
+                    clips.push_back({recordings.size(), reg[0].get<size_t>(), reg[1].get<size_t>(), 0});
                 }
             } else {
-                split(file.samples[0], vec);
+                split(file.samples[0], recordings.size(), vec, clips);
+            }
+            if (augment) {
+                recordings.emplace_back(move(file.samples[0]));
             }
         }
     }
     cerr << positive.size() << " positive and " << negative.size() << "negative samples" << endl;
     vector<vector<Tensor<float, FREQ_TO - FREQ_FROM>>> X_val, X_train;
     vector<bool> y_val, y_train;
+    vector<Clip> train_clips;
     size_t y_val_total_positive = 0;
     mt19937 rnd(42);
     for (auto &v : positive) {
         for (auto &x : v) {
-            auto s = accumulate(x.begin(), x.end(), 0.0f);
-            if (s < 1e-5)
-                s = 1e-5;
-            x /= s;
+            normalize(x);
         }
     }
     for (auto &v : negative) {
         for (auto &x : v) {
-            auto s = accumulate(x.begin(), x.end(), 0.0f);
-            if (s < 1e-5)
-                s = 1e-5;
-            x /= s;
+            normalize(x);
         }
     }
-    for (auto &x : positive) {
+    for (size_t i = 0; i < positive.size(); ++i) {
         if (rnd() % 10) {
-            X_train.emplace_back(move(x));
+            X_train.emplace_back(move(positive[i]));
             y_train.emplace_back(1);
+            train_clips.emplace_back(positive_clips[i]);
         } else {
-            X_val.emplace_back(move(x));
+            X_val.emplace_back(move(positive[i]));
             y_val.emplace_back(1);
             y_val_total_positive++;
         }
     }
-    for (auto &x : negative) {
+    for (size_t i = 0; i < negative.size(); ++i) {
         if (rnd() % 10) {
-            X_train.emplace_back(move(x));
+            X_train.emplace_back(move(negative[i]));
             y_train.emplace_back(0);
+            train_clips.emplace_back(negative_clips[i]);
         } else {
-            X_val.emplace_back(move(x));
+            X_val.emplace_back(move(negative[i]));
             y_val.emplace_back(0);
         }
     }
-    init(777);
-    for (size_t i = 0; i < X_train.size(); ++i) {
-        add_data(X_train[i][0].data(), X_train[i].size(), y_train[i]);
-    }
-    nlohmann::json report;
-    for (int i = 0; i < epochs; ++i) {
-        shuffle();
-        size_t iters = X_train.size() / TRAIN_SERIES_LEN;
-        float *losses = new float[iters];
-        train_epoch(0, TRAIN_SERIES_LEN, losses);
-        char buf[PATH_MAX];
-        snprintf(buf, sizeof(buf), argv[2], i);
-        cerr << buf << "\n";
-        save_to_file(buf);
-        nlohmann::json iteration_report;
-        iteration_report["train_loss"] = accumulate(losses, losses + iters, 0.0) / iters;
-        cerr << "Epoch #" << i << ":\n";
-        cerr << "train loss = " << iteration_report["train_loss"].get<double>() << endl;
+    Dataset train_data;
+    if (!augment) {
+        // Features are loaded once and only read by all configurations
+        for (size_t i = 0; i < X_train.size(); ++i) {
+            train_data.emplace_back(move(X_train[i]), y_train[i]);
+        }
+    }
+    X_train = {};
+    const auto known = architectures();
+    for (size_t k = 0; k < configs.size(); ++k) {
+        string prefix = sweep ? "Config #" + to_string(k) + ": " : "";
+        if (configs[k].seq == 0 || configs[k].seq > y_train.size()) {
+            cerr << prefix << "seq must be from 1 to " << y_train.size() << "\n";
+            return 1;
+        }
+        if (none_of(known.begin(), known.end(), [&](auto name) { return configs[k].model == name; })) {
+            cerr << prefix << "Unknown architecture " << configs[k].model << "\n";
+            return 1;
+        }
+    }
+    vector<vector<float>> noise;
+    for (auto &path : augmentation_config.noise) {
+        AudioFile<float> file;
+        file.load(string(argv[1]) + "/" + path);
+        assert(file.getSampleRate() == SAMPLE_RATE);
+        if (file.samples.empty() || file.samples[0].empty()) {
+            cerr << "Noise file " << path << " is empty, skipped\n";
+            continue;
+        }
+        noise.emplace_back(move(file.samples[0]));
+    }
+    Augmenter augmenter(augmentation_config, recordings, noise);
+    auto evaluate = [&](alina_model *snapshot, string name) {
+        alina_model_save(snapshot, name.c_str());
         vector<pair<float, bool>> results;
         results.reserve(y_val.size());
         for (size_t i = 0; i < y_val.size(); ++i) {
-            results.emplace_back(apply_to(X_val[i][0].data(), X_val[i].size(), nullptr), y_val[i]);
+            results.emplace_back(alina_model_apply_to(snapshot, X_val[i][0].data(), X_val[i].size(), nullptr), y_val[i]);
         }
+        float relative_cost = alina_model_cost(snapshot), speedup = alina_model_speedup(snapshot);
+        alina_model_free(snapshot);
         sort(results.begin(), results.end());
         vector<float> precisions, recalls, tresholds;
         precisions.reserve(y_val.size() + 1);
@@ -178,10 +255,145 @@ int main(int argc, char **argv) {
         }
         precisions.emplace_back(1);
         recalls.emplace_back(0);
+        nlohmann::json iteration_report;
         iteration_report["precisions"] = precisions;
         iteration_report["recalls"] = recalls;
         iteration_report["tresholds"] = tresholds;
-        report.push_back(iteration_report);
+        iteration_report["relative_cost"] = relative_cost;
+        iteration_report["sparse_speedup"] = speedup;
+        return iteration_report;
+    };
+
+    // Trains configuration k and returns its report
+    auto train = [&](size_t k) {
+        const auto &config = configs[k];
+        string prefix = sweep ? "Config #" + to_string(k) + ": " : "";
+        // Only the training loop is pinned, producers and evaluations spawned by it run on all CPUs
+        auto pinned = [&](auto &&f) {
+            if (sweep && !cpus.empty()) {
+                pin_thread(pthread_self(), {cpus[k % cpus.size()]});
+            }
+            f();
+            if (sweep && !cpus.empty()) {
+                pin_thread(pthread_self(), process_cpus);
+            }
+        };
+        auto trainer = trainer_create(config.seed, config.lr, config.positive_weight, config.model.c_str());
+        if (frozen_lower && !trainer_freeze_lower(trainer, frozen_lower)) {
+            cerr << prefix << "Can't load lower layers of " << config.model << " architecture from " << frozen_lower << "\n";
+            trainer_free(trainer);
+            return nlohmann::json();
+        }
+        vector<size_t> order(augment ? train_clips.size() : train_data.size());
+        iota(order.begin(), order.end(), 0);
+        // Producers render augmented samples into a bounded queue while the network trains on the previous ones
+        auto train_augmented_epoch = [&](int epoch, float *losses) {
+            trainer_shuffle(trainer, order);
+            BoundedQueue<pair<vector<Tensor<float, FREQ_TO - FREQ_FROM>>, bool>> queue(augmentation_config.queue_size);
+            atomic<size_t> next_clip = 0;
+            vector<thread> producers;
+            for (size_t t = 0; t < augmentation_config.producers; ++t) {
+                producers.emplace_back([&, t] {
+                    mt19937 producer_rnd((k * epochs + epoch) * augmentation_config.producers + t);
+                    vector<float> wave;
+                    for (size_t i; (i = next_clip++) < order.size();) {
+                        pair<vector<Tensor<float, FREQ_TO - FREQ_FROM>>, bool> sample;
+                        augmenter(train_clips[order[i]], producer_rnd, wave, sample.first);
+                        sample.second = y_train[order[i]];
+                        queue.push(move(sample));
+                    }
+                });
+            }
+            pinned([&] {
+                trainer_train_epoch_from(trainer, order.size(), config.seq, losses, [&queue](auto &x, bool &y) {
+                    auto sample = queue.pop();
+                    x = move(sample.first);
+                    y = sample.second;
+                    return true;
+                });
+            });
+            for (auto &t : producers) {
+                t.join();
+            }
+        };
+        // Saving and validation of epoch i run in the background while epoch i + 1 trains
+        const size_t MAX_PENDING_EVALUATIONS = max<size_t>(1, thread::hardware_concurrency() / 2 / configs.size());
+        deque<future<nlohmann::json>> pending;
+        vector<float> train_losses;
+        nlohmann::json report = nlohmann::json::array();
+        auto collect = [&]() {
+            auto iteration_report = pending.front().get();
+            pending.pop_front();
+            iteration_report["train_loss"] = train_losses[report.size()];
+            report.push_back(iteration_report);
+        };
+        // Pruning grows during the first half of the last prune_epochs epochs, the rest fine-tunes the pruned model
+        const int prune_from = epochs - prune_epochs, prune_ramp = max(1, prune_epochs / 2);
+        for (int i = 0; i < epochs; ++i) {
+            if ((prune_neurons || prune_blocks) && i >= prune_from) {
+                float part = min(1.0f, (float) (i - prune_from + 1) / prune_ramp);
+                trainer_prune(trainer, prune_neurons * part, prune_blocks * part);
+            }
+            size_t iters = y_train.size() / config.seq;
+            vector<float> losses(iters);
+            if (augment) {
+                train_augmented_epoch(i, losses.data());
+            } else {
+                trainer_shuffle(trainer, order);
+                pinned([&] {
+                    trainer_train_epoch(trainer, train_data, order, config.seq, losses.data());
+                });
+            }
+            char buf[PATH_MAX];
+            snprintf(buf, sizeof(buf), argv[2], i);
+            string name = sweep ? string(buf) + "." + to_string(k) : buf;
+            train_losses.emplace_back(accumulate(losses.begin(), losses.end(), 0.0) / iters);
+            // Written at once, so lines of concurrent configurations don't mix
+            ostringstream log;
+            log << prefix << name << "\n" << prefix << "Epoch #" << i << ":\n";
+            log << prefix << "train loss = " << train_losses.back() << "\n";
+            cerr << log.str() << flush;
+            if (pending.size() >= MAX_PENDING_EVALUATIONS) {
+                collect();
+            }
+            pending.emplace_back(async(launch::async, evaluate, trainer_snapshot(trainer), name));
+        }
+        while (!pending.empty()) {
+            collect();
+        }
+        trainer_free(trainer);
+        return report;
+    };
+
+    if (!sweep) {
+        auto report = train(0);
+        if (report.is_null()) {
+            return 1;
+        }
+        cout << report.dump() << "\n";
+        return 0;
+    }
+    // Configurations train concurrently, each in its own thread
+    vector<nlohmann::json> reports(configs.size());
+    vector<thread> threads;
+    for (size_t k = 0; k < configs.size(); ++k) {
+        threads.emplace_back([&, k] {
+            reports[k] = train(k);
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    nlohmann::json report = nlohmann::json::array();
+    for (size_t k = 0; k < configs.size(); ++k) {
+        report.push_back({
+            {"seed", configs[k].seed},
+            {"lr", configs[k].lr},
+            {"positive_weight", configs[k].positive_weight},
+            {"seq", configs[k].seq},
+            {"model", configs[k].model},
+            {"epochs", reports[k]},
+        });
     }
     cout << report.dump() << "\n";
 }